@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef ALLOC_INCLUDE_GUARD
+#define ALLOC_INCLUDE_GUARD
+
+/* Buffer allocators, selected with DRI2TO3_ALLOCATOR.  DRI2 clients only
+ * get a GEM name and a pitch for each buffer, so whatever layout is picked
+ * must be one the client driver can render to without being told. */
+
+struct alloc_bo {
+        uint32_t handle;
+        uint32_t pitch;
+        uint64_t size;
+        uint64_t modifier;
+
+        /* dma-buf for the server, closed once the pixmap is created */
+        int fd;
+
+        void *priv;
+};
+
+struct allocator {
+        const char *name;
+
+        /* Whether create can use anything but linear */
+        bool modifiers;
+
+        /* modifiers lists the layouts both sides accept, in order of
+         * preference; with none, the buffer is linear */
+        bool (*create)(int drm_fd, uint32_t width, uint32_t height,
+                       uint32_t depth, uint32_t bpp,
+                       const uint64_t *modifiers, unsigned num_modifiers,
+                       struct alloc_bo *bo);
+        void (*destroy)(int drm_fd, struct alloc_bo *bo);
+};
+
+static bool
+alloc_dumb_create(int drm_fd, uint32_t width, uint32_t height,
+                  uint32_t depth, uint32_t bpp,
+                  const uint64_t *modifiers, unsigned num_modifiers,
+                  struct alloc_bo *bo)
+{
+        struct drm_mode_create_dumb create = {
+                .width = width,
+                .height = height,
+                .bpp = bpp,
+        };
+        if (ioctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+                return false;
+
+        struct drm_prime_handle handle = {
+                .handle = create.handle,
+        };
+        ioctl(drm_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &handle);
+
+        /* Dumb buffers are always linear */
+        *bo = (struct alloc_bo) {
+                .handle = create.handle,
+                .pitch = create.pitch,
+                .size = create.size,
+                .modifier = DRM_FORMAT_MOD_LINEAR,
+                .fd = handle.fd,
+        };
+
+        return true;
+}
+
+static void
+alloc_dumb_destroy(int drm_fd, struct alloc_bo *bo)
+{
+        struct drm_gem_close close = {
+                .handle = bo->handle,
+        };
+        ioctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &close);
+}
+
+static const struct allocator alloc_dumb = {
+        .name = "dumb",
+        .create = alloc_dumb_create,
+        .destroy = alloc_dumb_destroy,
+};
+
+#ifdef HAVE_GBM
+
+/* One device per DRM fd, kept for as long as it has BOs */
+struct alloc_gbm_device {
+        struct alloc_gbm_device *next;
+        int drm_fd;
+        struct gbm_device *gbm;
+        unsigned refs;
+};
+
+static pthread_mutex_t alloc_gbm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct alloc_gbm_device *alloc_gbm_devices;
+
+static struct gbm_device *
+alloc_gbm_get_device(int drm_fd)
+{
+        pthread_mutex_lock(&alloc_gbm_lock);
+        struct alloc_gbm_device *dev;
+        for (dev = alloc_gbm_devices; dev; dev = dev->next) {
+                if (dev->drm_fd == drm_fd)
+                        break;
+        }
+
+        if (!dev) {
+                struct gbm_device *gbm = gbm_create_device(drm_fd);
+                if (gbm) {
+                        dev = malloc(sizeof(*dev));
+                        *dev = (struct alloc_gbm_device) {
+                                .next = alloc_gbm_devices,
+                                .drm_fd = drm_fd,
+                                .gbm = gbm,
+                        };
+                        alloc_gbm_devices = dev;
+                }
+        }
+
+        if (dev)
+                ++dev->refs;
+        pthread_mutex_unlock(&alloc_gbm_lock);
+
+        return dev ? dev->gbm : NULL;
+}
+
+static void
+alloc_gbm_put_device(struct gbm_device *gbm)
+{
+        pthread_mutex_lock(&alloc_gbm_lock);
+        for (struct alloc_gbm_device **link = &alloc_gbm_devices; *link;
+             link = &(*link)->next) {
+                struct alloc_gbm_device *dev = *link;
+                if (dev->gbm != gbm)
+                        continue;
+
+                if (!--dev->refs) {
+                        *link = dev->next;
+                        gbm_device_destroy(dev->gbm);
+                        free(dev);
+                }
+                break;
+        }
+        pthread_mutex_unlock(&alloc_gbm_lock);
+}
+
+static uint32_t
+alloc_gbm_format(uint32_t depth)
+{
+        switch (depth) {
+        case 8: return DRM_FORMAT_R8;
+        case 16: return DRM_FORMAT_RGB565;
+        case 30: return DRM_FORMAT_XRGB2101010;
+        case 32: return DRM_FORMAT_ARGB8888;
+        default: return DRM_FORMAT_XRGB8888;
+        }
+}
+
+static bool
+alloc_gbm_create(int drm_fd, uint32_t width, uint32_t height,
+                 uint32_t depth, uint32_t bpp,
+                 const uint64_t *modifiers, unsigned num_modifiers,
+                 struct alloc_bo *bo)
+{
+        struct gbm_device *gbm = alloc_gbm_get_device(drm_fd);
+        if (!gbm)
+                return false;
+
+        uint32_t format = alloc_gbm_format(depth);
+        struct gbm_bo *gbo;
+
+        /* Without a negotiated list, fall back to what DRI2 assumes */
+        if (num_modifiers)
+                gbo = gbm_bo_create_with_modifiers(gbm, width, height, format,
+                                                   modifiers, num_modifiers);
+        else
+                gbo = gbm_bo_create(gbm, width, height, format,
+                                    GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
+
+        if (!gbo) {
+                alloc_gbm_put_device(gbm);
+                return false;
+        }
+
+        /* A DRI2 buffer is a single GEM name */
+        if (gbm_bo_get_plane_count(gbo) != 1) {
+                gbm_bo_destroy(gbo);
+                alloc_gbm_put_device(gbm);
+                return false;
+        }
+
+        *bo = (struct alloc_bo) {
+                .handle = gbm_bo_get_handle(gbo).u32,
+                .pitch = gbm_bo_get_stride(gbo),
+                .modifier = num_modifiers ? gbm_bo_get_modifier(gbo) :
+                        DRM_FORMAT_MOD_LINEAR,
+                .fd = gbm_bo_get_fd(gbo),
+                .priv = gbo,
+        };
+        bo->size = (uint64_t) bo->pitch * gbm_bo_get_height(gbo);
+
+        return true;
+}
+
+static void
+alloc_gbm_destroy(int drm_fd, struct alloc_bo *bo)
+{
+        struct gbm_device *gbm = gbm_bo_get_device(bo->priv);
+
+        gbm_bo_destroy(bo->priv);
+        alloc_gbm_put_device(gbm);
+}
+
+static const struct allocator alloc_gbm_backend = {
+        .name = "gbm",
+        .modifiers = true,
+        .create = alloc_gbm_create,
+        .destroy = alloc_gbm_destroy,
+};
+
+#endif
+
+#ifdef DRI2TO3_TESTS
+
+/* For the tests: a dumb buffer that claims the preferred modifier, as a
+ * driver's allocator would pick it */
+static bool
+alloc_stub_create(int drm_fd, uint32_t width, uint32_t height,
+                  uint32_t depth, uint32_t bpp,
+                  const uint64_t *modifiers, unsigned num_modifiers,
+                  struct alloc_bo *bo)
+{
+        if (!alloc_dumb_create(drm_fd, width, height, depth, bpp,
+                               NULL, 0, bo))
+                return false;
+
+        if (num_modifiers)
+                bo->modifier = modifiers[0];
+
+        return true;
+}
+
+static const struct allocator alloc_stub = {
+        .name = "stub",
+        .modifiers = true,
+        .create = alloc_stub_create,
+        .destroy = alloc_dumb_destroy,
+};
+
+#endif
+
+static const struct allocator *allocators[] = {
+        &alloc_dumb,
+#ifdef HAVE_GBM
+        &alloc_gbm_backend,
+#endif
+#ifdef DRI2TO3_TESTS
+        &alloc_stub,
+#endif
+};
+
+static const struct allocator *
+alloc_find(const char *name)
+{
+        for (unsigned i = 0; i < sizeof(allocators) / sizeof(*allocators); ++i) {
+                if (!strcmp(allocators[i]->name, name))
+                        return allocators[i];
+        }
+
+        return NULL;
+}
+
+#endif
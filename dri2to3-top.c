@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Shows live per-window statistics of every process running with
+ * DRI2TO3_STATS set, by reading their /dev/shm/dri2to3-<pid> segments. */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define MAX_PROCESSES 64
+
+struct process {
+        int pid;
+        const struct stats_shm *shm;
+        struct stats_drawable prev[STATS_MAX_DRAWABLES];
+        struct stats_ioctl prev_ioctls[STATS_MAX_IOCTLS];
+        bool seen;
+};
+
+static struct process processes[MAX_PROCESSES];
+static unsigned num_processes;
+static unsigned show_ioctls;
+
+static struct process *
+find_process(int pid)
+{
+        for (unsigned i = 0; i < num_processes; ++i) {
+                if (processes[i].pid == pid)
+                        return &processes[i];
+        }
+
+        return NULL;
+}
+
+static void
+attach(int pid)
+{
+        char name[32];
+        snprintf(name, sizeof(name), STATS_NAME_FORMAT, pid);
+
+        /* Left behind by a process that crashed */
+        if (kill(pid, 0) && (errno == ESRCH)) {
+                shm_unlink(name);
+                return;
+        }
+
+        if (num_processes == MAX_PROCESSES)
+                return;
+
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0)
+                return;
+
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (!fstat(fd, &st) && (st.st_size >= (off_t) sizeof(struct stats_shm)))
+                map = mmap(NULL, sizeof(struct stats_shm), PROT_READ,
+                           MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (map == MAP_FAILED)
+                return;
+
+        const struct stats_shm *shm = map;
+        if ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC) ||
+            (shm->version != STATS_VERSION)) {
+                munmap(map, sizeof(struct stats_shm));
+                return;
+        }
+
+        struct process *p = &processes[num_processes++];
+        *p = (struct process) {
+                .pid = pid,
+                .shm = shm,
+                .seen = true,
+        };
+        memcpy(p->prev, shm->drawables, sizeof(p->prev));
+        memcpy(p->prev_ioctls, shm->ioctls, sizeof(p->prev_ioctls));
+}
+
+static void
+scan(void)
+{
+        for (unsigned i = 0; i < num_processes; ++i)
+                processes[i].seen = false;
+
+        DIR *dir = opendir("/dev/shm");
+        if (!dir)
+                return;
+
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+                int pid;
+                if (sscanf(ent->d_name, "dri2to3-%d", &pid) != 1)
+                        continue;
+
+                struct process *p = find_process(pid);
+                if (p)
+                        p->seen = true;
+                else
+                        attach(pid);
+        }
+        closedir(dir);
+
+        for (unsigned i = 0; i < num_processes;) {
+                if (processes[i].seen && !kill(processes[i].pid, 0)) {
+                        ++i;
+                        continue;
+                }
+
+                munmap((void *) processes[i].shm, sizeof(struct stats_shm));
+                processes[i] = processes[--num_processes];
+        }
+}
+
+/* Upper bound of the bucket holding the given percentile, in ms */
+static double
+percentile(const struct stats_hist *cur, const struct stats_hist *prev,
+           double pct)
+{
+        uint64_t delta[STATS_HIST_BUCKETS];
+        uint64_t total = 0;
+
+        for (unsigned i = 0; i < STATS_HIST_BUCKETS; ++i) {
+                delta[i] = cur->count[i] - prev->count[i];
+                total += delta[i];
+        }
+
+        if (!total)
+                return 0;
+
+        uint64_t target = total * pct / 100;
+        uint64_t sum = 0;
+
+        for (unsigned i = 0; i < STATS_HIST_BUCKETS; ++i) {
+                sum += delta[i];
+                if (sum > target)
+                        return (double) (2ull << i) / 1000;
+        }
+
+        return (double) (2ull << (STATS_HIST_BUCKETS - 1)) / 1000;
+}
+
+static void
+print_hist(const struct stats_hist *cur, const struct stats_hist *prev)
+{
+        printf(" %6.1f %6.1f %6.1f",
+               percentile(cur, prev, 50),
+               percentile(cur, prev, 90),
+               percentile(cur, prev, 99));
+}
+
+static int
+compare_ioctl_time(const void *a, const void *b)
+{
+        const struct stats_ioctl *x = a, *y = b;
+
+        return (x->total_ns < y->total_ns) - (x->total_ns > y->total_ns);
+}
+
+/* The busiest ioctls of each process over the last interval, from the
+ * DRI2TO3_PROFILE export */
+static void
+show_ioctl_profile(double interval)
+{
+        printf("\n%7s %-15s %6s %4s %9s %9s %9s  %-13s\n",
+               "PID", "COMMAND", "TYPE", "NR", "CALLS/s", "TIME(ms)",
+               "AVG(us)", "p50/99 us");
+
+        for (unsigned i = 0; i < num_processes; ++i) {
+                struct process *p = &processes[i];
+                struct stats_ioctl delta[STATS_MAX_IOCTLS];
+                unsigned count = 0;
+
+                for (unsigned j = 0; j < STATS_MAX_IOCTLS; ++j) {
+                        struct stats_ioctl cur = p->shm->ioctls[j];
+                        struct stats_ioctl *prev = &p->prev_ioctls[j];
+
+                        if (prev->key != cur.key)
+                                memset(prev, 0, sizeof(*prev));
+
+                        if (cur.key && (cur.count > prev->count)) {
+                                struct stats_ioctl *d = &delta[count++];
+                                *d = cur;
+                                d->count -= prev->count;
+                                d->total_ns -= prev->total_ns;
+                                for (unsigned b = 0; b < STATS_HIST_BUCKETS; ++b)
+                                        d->latency.count[b] -= prev->latency.count[b];
+                        }
+
+                        *prev = cur;
+                }
+
+                qsort(delta, count, sizeof(*delta), compare_ioctl_time);
+
+                static const struct stats_hist zero;
+
+                for (unsigned j = 0; j < count && j < show_ioctls; ++j) {
+                        struct stats_ioctl *d = &delta[j];
+                        unsigned type = STATS_IOCTL_TYPE(d->key);
+
+                        char name[8];
+                        if ((type >= 0x20) && (type < 0x7f))
+                                snprintf(name, sizeof(name), "'%c'", type);
+                        else
+                                snprintf(name, sizeof(name), "0x%02x", type);
+
+                        printf("%7d %-15.15s %6s 0x%02x %9.1f %9.2f %9.2f  %6.0f %6.0f\n",
+                               p->pid, p->shm->comm, name, STATS_IOCTL_NR(d->key),
+                               d->count / interval, d->total_ns / 1e6,
+                               d->total_ns / 1e3 / d->count,
+                               percentile(&d->latency, &zero, 50) * 1000,
+                               percentile(&d->latency, &zero, 99) * 1000);
+                }
+        }
+}
+
+static void
+show(double interval)
+{
+        printf("\033[H\033[2J");
+        printf("%7s %-15s %9s %11s %6s %8s %6s  %-20s  %-20s  %-20s\n",
+               "PID", "COMMAND", "DRAWABLE", "SIZE", "FPS", "MEM(MiB)",
+               "BUFS", "frame p50/90/99 ms", "present p50/90/99 ms",
+               "wait p50/90/99 ms");
+
+        for (unsigned i = 0; i < num_processes; ++i) {
+                struct process *p = &processes[i];
+
+                for (unsigned j = 0; j < STATS_MAX_DRAWABLES; ++j) {
+                        struct stats_drawable cur = p->shm->drawables[j];
+                        struct stats_drawable *prev = &p->prev[j];
+
+                        if (!cur.in_use) {
+                                prev->in_use = 0;
+                                continue;
+                        }
+
+                        /* A new drawable took over this slot */
+                        if (!prev->in_use || (prev->generation != cur.generation))
+                                memset(prev, 0, sizeof(*prev));
+
+                        char size[16];
+                        snprintf(size, sizeof(size), "%ux%u",
+                                 cur.width, cur.height);
+
+                        printf("%7d %-15.15s %9x %11s %6.1f %8.1f %2u/%-3u",
+                               p->pid, p->shm->comm, cur.drawable, size,
+                               (cur.frames - prev->frames) / interval,
+                               cur.bytes / (1024.0 * 1024.0),
+                               cur.buffers, cur.max_buffers);
+                        print_hist(&cur.frame_time, &prev->frame_time);
+                        print_hist(&cur.present_latency, &prev->present_latency);
+                        print_hist(&cur.wait_time, &prev->wait_time);
+                        printf("\n");
+
+                        *prev = cur;
+                }
+        }
+
+        if (show_ioctls)
+                show_ioctl_profile(interval);
+
+        fflush(stdout);
+}
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr, "usage: %s [-d seconds] [-n iterations] [-i ioctls]\n", argv0);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        double interval = 1.0;
+        long iterations = -1;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "d:i:n:")) != -1) {
+                switch (opt) {
+                case 'd':
+                        interval = strtod(optarg, NULL);
+                        break;
+                case 'i':
+                        show_ioctls = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        iterations = strtol(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (interval <= 0)
+                usage(argv[0]);
+
+        struct timespec delay = {
+                .tv_sec = (time_t) interval,
+                .tv_nsec = (long) ((interval - (time_t) interval) * 1e9),
+        };
+
+        scan();
+
+        while (iterations--) {
+                nanosleep(&delay, NULL);
+                scan();
+                show(interval);
+        }
+
+        return 0;
+}
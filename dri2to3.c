@@ -24,25 +24,50 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include <drm.h>
 #include <drm_mode.h>
+#include <drm_fourcc.h>
 #include <xcb/present.h>
 #include <xcb/dri2.h>
 #include <xcb/dri3.h>
+#include <xcb/xfixes.h>
 
-#include "lib2to3.h"
+#ifdef HAVE_GBM
+#include <gbm.h>
+#endif
+
+#ifdef HAVE_XSHMFENCE
+#include <xcb/sync.h>
+#include <X11/xshmfence.h>
+#endif
 
 #define DEVICE_NAME "/dev/dri/card0"
 
+#include "dri2to3.h"
+#include "lib2to3.h"
+
 #define DLSYM(name) static typeof(name) *orig_##name; \
         if (!orig_##name) orig_##name = dlsym(RTLD_NEXT, #name)
 
@@ -67,16 +92,7 @@ xcb_dri2_connect(xcb_connection_t *conn, xcb_window_t window, uint32_t driver_ty
 
         lib2to3_init();
 
-        xcb_generic_error_t *error;
-        xcb_dri3_query_version_cookie_t ver_cookie =
-                xcb_dri3_query_version(conn, 1, 2);
-
-        xcb_dri3_query_version_reply_t *ver =
-                xcb_dri3_query_version_reply(conn, ver_cookie, &error);
-
-        LOG("DRI3 version: %i.%i\n", ver->major_version, ver->minor_version);
-
-        free(ver);
+        lib2to3_get_connection(conn, window);
 
         return (xcb_dri2_connect_cookie_t) { .sequence = 0 };
 }
@@ -87,18 +103,30 @@ xcb_dri2_connect_reply(xcb_connection_t *conn, xcb_dri2_connect_cookie_t cookie,
 {
         LOG("MY xcb_dri2_connect_reply\n");
 
-        struct {
-                xcb_dri2_connect_reply_t reply;
-                char device_name[sizeof(DEVICE_NAME)];
-        } reply = {
-                .reply = {
-                        .response_type = XCB_DRI2_CONNECT,
-                        .device_name_length = sizeof(DEVICE_NAME),
-                },
-                .device_name = DEVICE_NAME,
+        LOCK();
+        struct connection *c = lib2to3_find_connection_locked(conn);
+        UNLOCK();
+
+        /* The connection failed, see lib2to3_get_connection */
+        if (!c)
+                RETURN_NULL();
+
+        const char *device_name = c->device_name;
+        uint32_t length = strlen(device_name) + 1;
+
+        /* The device name follows the reply, padded to 4 bytes */
+        xcb_dri2_connect_reply_t *reply =
+                calloc(1, sizeof(*reply) + ((length + 3) & ~3));
+        *reply = (xcb_dri2_connect_reply_t) {
+                .response_type = XCB_DRI2_CONNECT,
+                .device_name_length = length,
+                .length = (length + 3) / 4,
         };
+        memcpy(reply + 1, device_name, length);
 
-        RETURN(reply);
+        if (e)
+                *e = NULL;
+        return reply;
 }
 
 xcb_dri2_authenticate_cookie_t
@@ -150,6 +178,14 @@ xcb_void_cookie_t
 xcb_dri2_swap_interval(xcb_connection_t *conn, xcb_drawable_t drawable, uint32_t interval)
 {
         LOG("MY xcb_dri2_swap_interval %i\n", interval);
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (d) {
+                d->swap_interval = interval;
+                lib2to3_unlock_drawable(d);
+        }
+
         return (xcb_void_cookie_t) { .sequence = 0 };
 }
 
@@ -158,18 +194,9 @@ xcb_dri2_create_drawable_checked(xcb_connection_t *conn, xcb_drawable_t drawable
 {
         LOG("MY xcb_dri2_create_drawable %i\n", drawable);
 
-        xcb_generic_error_t *error;
-        xcb_dri3_open_cookie_t open_cookie =
-                xcb_dri3_open(conn, drawable, 0);
-
-        xcb_dri3_open_reply_t *open =
-                xcb_dri3_open_reply(conn, open_cookie, &error);
-
-        LOG("DRI3 nfd %i\n", open->nfd);
-
-        free(open);
-
-        lib2to3_create_drawable(conn, drawable, drm_fd);
+        struct connection *c = lib2to3_get_connection(conn, drawable);
+        if (c)
+                lib2to3_create_drawable(c, drawable, drm_fd);
 
         return (xcb_void_cookie_t) { .sequence = 0 };
 }
@@ -181,49 +208,118 @@ xcb_dri2_get_buffers(xcb_connection_t *conn, xcb_drawable_t drawable,
 {
         LOG("MY xcb_dri2_get_buffers %i: %i/%i: %x\n", drawable,
                count, attachments_len, attachments[0]);
-        assert(count == 1);
         assert(count == attachments_len);
-        assert(attachments[0] == XCB_DRI2_ATTACHMENT_BUFFER_BACK_LEFT);
+
+        TRACE_BEGIN(TRACE_GET_BUFFERS, drawable);
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (d) {
+                lib2to3_get_buffers(d, count, attachments, false);
+                lib2to3_unlock_drawable(d);
+        }
+
+        TRACE_END(TRACE_GET_BUFFERS, drawable);
+
         return (xcb_dri2_get_buffers_cookie_t) { .sequence = drawable };
 }
 
-xcb_dri2_get_buffers_reply_t *
-xcb_dri2_get_buffers_reply(xcb_connection_t *conn, xcb_dri2_get_buffers_cookie_t cookie,
-                           xcb_generic_error_t **e)
+/* GetBuffers and GetBuffersWithFormat replies share a layout */
+static xcb_dri2_get_buffers_reply_t *
+get_buffers_reply(xcb_connection_t *conn, xcb_drawable_t drawable,
+                  uint8_t response_type, xcb_generic_error_t **e)
 {
-        LOG("MY xcb_dri2_get_buffers_reply %x\n", cookie.sequence);
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
 
-        xcb_drawable_t drawable = cookie.sequence;
+        if (!d)
+                RETURN_NULL();
 
-        struct drawable *d = lib2to3_get_drawable(conn, drawable);
+        xcb_dri2_get_buffers_reply_t *reply =
+                calloc(1, sizeof(*reply) +
+                       d->num_attachments * sizeof(xcb_dri2_dri2_buffer_t));
+        xcb_dri2_dri2_buffer_t *buffers = (void *) (reply + 1);
+        unsigned count = 0;
 
-        struct buffer *b = lib2to3_get_buffer(d);
+        for (unsigned i = 0; i < d->num_attachments; ++i) {
+                struct buffer *b =
+                        lib2to3_attachment_buffer(d, d->attachments[i]);
 
-        if (!b)
-                RETURN_NULL();
+                if (!b)
+                        continue;
 
-        lib2to3_set_handle_size(b->handle, b->size);
-        
-        struct {
-                xcb_dri2_get_buffers_reply_t reply;
-                xcb_dri2_dri2_buffer_t buffer;
-        } reply = {
-                .reply = {
-                        .response_type = XCB_DRI2_GET_BUFFERS,
-                        .width = b->width,
-                        .height = b->height,
-                        .count = 1,
-                },
-                .buffer = {
-                        .attachment = 1,
+                buffers[count++] = (xcb_dri2_dri2_buffer_t) {
+                        .attachment = d->attachments[i],
                         .name = b->handle,
                         .pitch = b->pitch,
                         .cpp = b->cpp,
                         .flags = 0,
-                },
-        };
+                };
 
-        RETURN(reply);
+                reply->width = b->width;
+                reply->height = b->height;
+        }
+
+        lib2to3_unlock_drawable(d);
+
+        if (!count) {
+                free(reply);
+                RETURN_NULL();
+        }
+
+        reply->response_type = response_type;
+        reply->count = count;
+        reply->length = count * sizeof(xcb_dri2_dri2_buffer_t) / 4;
+
+        if (e)
+                *e = NULL;
+        return reply;
+}
+
+xcb_dri2_get_buffers_reply_t *
+xcb_dri2_get_buffers_reply(xcb_connection_t *conn, xcb_dri2_get_buffers_cookie_t cookie,
+                           xcb_generic_error_t **e)
+{
+        LOG("MY xcb_dri2_get_buffers_reply %x\n", cookie.sequence);
+
+        return get_buffers_reply(conn, cookie.sequence,
+                                 XCB_DRI2_GET_BUFFERS, e);
+}
+
+xcb_dri2_get_buffers_with_format_cookie_t
+xcb_dri2_get_buffers_with_format(xcb_connection_t *conn, xcb_drawable_t drawable,
+                                 uint32_t count, uint32_t attachments_len,
+                                 const xcb_dri2_attach_format_t *attachments)
+{
+        LOG("MY xcb_dri2_get_buffers_with_format %i: %i/%i: %x/%i\n", drawable,
+               count, attachments_len, attachments[0].attachment,
+               attachments[0].format);
+        assert(count == attachments_len);
+
+        TRACE_BEGIN(TRACE_GET_BUFFERS, drawable);
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (d) {
+                lib2to3_get_buffers(d, count, (const uint32_t *) attachments,
+                                    true);
+                lib2to3_unlock_drawable(d);
+        }
+
+        TRACE_END(TRACE_GET_BUFFERS, drawable);
+
+        return (xcb_dri2_get_buffers_with_format_cookie_t) { .sequence = drawable };
+}
+
+xcb_dri2_get_buffers_with_format_reply_t *
+xcb_dri2_get_buffers_with_format_reply(xcb_connection_t *conn,
+                                       xcb_dri2_get_buffers_with_format_cookie_t cookie,
+                                       xcb_generic_error_t **e)
+{
+        LOG("MY xcb_dri2_get_buffers_with_format_reply %x\n", cookie.sequence);
+
+        return (xcb_dri2_get_buffers_with_format_reply_t *)
+                get_buffers_reply(conn, cookie.sequence,
+                                  XCB_DRI2_GET_BUFFERS_WITH_FORMAT, e);
 }
 
 xcb_dri2_swap_buffers_cookie_t
@@ -233,6 +329,22 @@ xcb_dri2_swap_buffers(xcb_connection_t *conn, xcb_drawable_t drawable,
                       uint32_t remainder_hi, uint32_t remainder_lo)
 {
         LOG("MY xcb_dri2_swap_buffers\n");
+
+        TRACE_BEGIN(TRACE_SWAP, drawable);
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (d) {
+                if (d->cur)
+                        lib2to3_swap_buffers(d,
+                                             ((uint64_t) target_msc_hi << 32) | target_msc_lo,
+                                             ((uint64_t) divisor_hi << 32) | divisor_lo,
+                                             ((uint64_t) remainder_hi << 32) | remainder_lo);
+                lib2to3_unlock_drawable(d);
+        }
+
+        TRACE_END(TRACE_SWAP, drawable);
+
         return (xcb_dri2_swap_buffers_cookie_t) { .sequence = drawable };
 }
 
@@ -245,18 +357,170 @@ xcb_dri2_swap_buffers_reply(xcb_connection_t *conn,
 
         xcb_drawable_t drawable = cookie.sequence;
 
-        struct drawable *d = lib2to3_get_drawable(conn, drawable);
-
-        xcb_present_pixmap(conn, drawable, d->cur->pixmap, ++d->present_serial,
-                           0, 0, 0, 0, 0, 0, 0, XCB_PRESENT_OPTION_ASYNC,
-                           0, 0, 0, 0, NULL);
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
 
-        lib2to3_drawable_swap(d);
+        if (!d)
+                RETURN_NULL();
+        uint64_t sbc = d->send_sbc;
+        lib2to3_unlock_drawable(d);
 
         xcb_dri2_swap_buffers_reply_t reply = {
                 .response_type = XCB_DRI2_SWAP_BUFFERS,
+                .swap_hi = sbc >> 32,
+                .swap_lo = sbc,
+        };
+
+        RETURN(reply);
+}
+
+xcb_dri2_get_msc_cookie_t
+xcb_dri2_get_msc(xcb_connection_t *conn, xcb_drawable_t drawable)
+{
+        LOG("MY xcb_dri2_get_msc\n");
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (d) {
+                lib2to3_notify_msc(d, 0, 0, 0);
+                lib2to3_unlock_drawable(d);
+        }
+
+        return (xcb_dri2_get_msc_cookie_t) { .sequence = drawable };
+}
+
+xcb_dri2_get_msc_reply_t *
+xcb_dri2_get_msc_reply(xcb_connection_t *conn, xcb_dri2_get_msc_cookie_t cookie,
+                       xcb_generic_error_t **e)
+{
+        LOG("MY xcb_dri2_get_msc_reply\n");
+
+        xcb_drawable_t drawable = cookie.sequence;
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (!d)
+                RETURN_NULL();
+
+        if (!lib2to3_wait_notify_msc(d)) {
+                lib2to3_unlock_drawable(d);
+                RETURN_NULL();
+        }
+
+        xcb_dri2_get_msc_reply_t reply = {
+                .response_type = XCB_DRI2_GET_MSC,
+                .ust_hi = d->notify_ust >> 32,
+                .ust_lo = d->notify_ust,
+                .msc_hi = d->notify_msc >> 32,
+                .msc_lo = d->notify_msc,
+                .sbc_hi = d->recv_sbc >> 32,
+                .sbc_lo = d->recv_sbc,
+        };
+
+        lib2to3_unlock_drawable(d);
+
+        RETURN(reply);
+}
+
+xcb_dri2_wait_msc_cookie_t
+xcb_dri2_wait_msc(xcb_connection_t *conn, xcb_drawable_t drawable,
+                  uint32_t target_msc_hi, uint32_t target_msc_lo,
+                  uint32_t divisor_hi, uint32_t divisor_lo,
+                  uint32_t remainder_hi, uint32_t remainder_lo)
+{
+        LOG("MY xcb_dri2_wait_msc\n");
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (d) {
+                lib2to3_notify_msc(d,
+                                   ((uint64_t) target_msc_hi << 32) | target_msc_lo,
+                                   ((uint64_t) divisor_hi << 32) | divisor_lo,
+                                   ((uint64_t) remainder_hi << 32) | remainder_lo);
+                lib2to3_unlock_drawable(d);
+        }
+
+        return (xcb_dri2_wait_msc_cookie_t) { .sequence = drawable };
+}
+
+xcb_dri2_wait_msc_reply_t *
+xcb_dri2_wait_msc_reply(xcb_connection_t *conn, xcb_dri2_wait_msc_cookie_t cookie,
+                        xcb_generic_error_t **e)
+{
+        LOG("MY xcb_dri2_wait_msc_reply\n");
+
+        xcb_drawable_t drawable = cookie.sequence;
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (!d)
+                RETURN_NULL();
+
+        if (!lib2to3_wait_notify_msc(d)) {
+                lib2to3_unlock_drawable(d);
+                RETURN_NULL();
+        }
+
+        xcb_dri2_wait_msc_reply_t reply = {
+                .response_type = XCB_DRI2_WAIT_MSC,
+                .ust_hi = d->notify_ust >> 32,
+                .ust_lo = d->notify_ust,
+                .msc_hi = d->notify_msc >> 32,
+                .msc_lo = d->notify_msc,
+                .sbc_hi = d->recv_sbc >> 32,
+                .sbc_lo = d->recv_sbc,
         };
 
+        lib2to3_unlock_drawable(d);
+
+        RETURN(reply);
+}
+
+xcb_dri2_wait_sbc_cookie_t
+xcb_dri2_wait_sbc(xcb_connection_t *conn, xcb_drawable_t drawable,
+                  uint32_t target_sbc_hi, uint32_t target_sbc_lo)
+{
+        LOG("MY xcb_dri2_wait_sbc\n");
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (d) {
+                d->wait_sbc = ((uint64_t) target_sbc_hi << 32) | target_sbc_lo;
+                lib2to3_unlock_drawable(d);
+        }
+
+        return (xcb_dri2_wait_sbc_cookie_t) { .sequence = drawable };
+}
+
+xcb_dri2_wait_sbc_reply_t *
+xcb_dri2_wait_sbc_reply(xcb_connection_t *conn, xcb_dri2_wait_sbc_cookie_t cookie,
+                        xcb_generic_error_t **e)
+{
+        LOG("MY xcb_dri2_wait_sbc_reply\n");
+
+        xcb_drawable_t drawable = cookie.sequence;
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (!d)
+                RETURN_NULL();
+
+        if (!lib2to3_wait_sbc(d, d->wait_sbc)) {
+                lib2to3_unlock_drawable(d);
+                RETURN_NULL();
+        }
+
+        xcb_dri2_wait_sbc_reply_t reply = {
+                .response_type = XCB_DRI2_WAIT_SBC,
+                .ust_hi = d->ust >> 32,
+                .ust_lo = d->ust,
+                .msc_hi = d->msc >> 32,
+                .msc_lo = d->msc,
+                .sbc_hi = d->recv_sbc >> 32,
+                .sbc_lo = d->recv_sbc,
+        };
+
+        lib2to3_unlock_drawable(d);
+
         RETURN(reply);
 }
 
@@ -268,23 +532,167 @@ xcb_dri2_destroy_drawable_checked(xcb_connection_t *conn, xcb_drawable_t drawabl
         return (xcb_void_cookie_t) { .sequence = 0 };
 }
 
+xcb_dri2_copy_region_cookie_t
+xcb_dri2_copy_region(xcb_connection_t *conn, xcb_drawable_t drawable,
+                     uint32_t region, uint32_t dest, uint32_t src)
+{
+        LOG("MY xcb_dri2_copy_region %i: %x %x -> %x\n", drawable,
+            region, src, dest);
+
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (d) {
+                lib2to3_copy_region(d, region, dest, src);
+                lib2to3_unlock_drawable(d);
+        }
+
+        return (xcb_dri2_copy_region_cookie_t) { .sequence = drawable };
+}
+
+xcb_dri2_copy_region_reply_t *
+xcb_dri2_copy_region_reply(xcb_connection_t *conn,
+                           xcb_dri2_copy_region_cookie_t cookie,
+                           xcb_generic_error_t **e)
+{
+        LOG("MY xcb_dri2_copy_region_reply\n");
+
+        xcb_dri2_copy_region_reply_t reply = {
+                .response_type = XCB_DRI2_COPY_REGION,
+        };
+
+        RETURN(reply);
+}
+
 int
-ioctl(int fd, unsigned long request, ...)
+dri2to3_set_buffer_count(xcb_connection_t *conn, xcb_drawable_t drawable,
+                         unsigned count)
+{
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (!d)
+                return -1;
+        lib2to3_set_buffer_count(d, count);
+        lib2to3_unlock_drawable(d);
+
+        return 0;
+}
+
+int
+dri2to3_set_max_wait(xcb_connection_t *conn, xcb_drawable_t drawable,
+                     unsigned ms)
 {
-        DLSYM(ioctl);
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
 
+        if (!d)
+                return -1;
+        d->max_wait_ns = ms * 1000000ull;
+        lib2to3_unlock_drawable(d);
+
+        return 0;
+}
+
+int
+dri2to3_set_damage(xcb_connection_t *conn, xcb_drawable_t drawable,
+                   uint32_t n, const xcb_rectangle_t *rects)
+{
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (!d)
+                return -1;
+        lib2to3_add_damage(d, n, rects);
+        lib2to3_unlock_drawable(d);
+
+        return 0;
+}
+
+int
+dri2to3_get_drawable_stats(xcb_connection_t *conn, xcb_drawable_t drawable,
+                           struct dri2to3_drawable_stats *stats)
+{
+        struct drawable *d = lib2to3_lock_drawable(conn, drawable);
+
+        if (!d)
+                return -1;
+        *stats = d->stats;
+        stats->buffers = d->num_buffers;
+        stats->max_buffers = d->max_buffers;
+        lib2to3_unlock_drawable(d);
+
+        return 0;
+}
+
+void
+xcb_disconnect(xcb_connection_t *conn)
+{
+        DLSYM(xcb_disconnect);
+
+        LOG("MY xcb_disconnect\n");
+
+        /* Frees the remaining drawables, whose buffers go to the pool */
+        lib2to3_free_connection(conn);
+        lib2to3_pool_drop_conn(conn);
+
+        orig_xcb_disconnect(conn);
+}
+
+/* Every ioctl in the process comes through here.  Those that are not
+ * DRM go to forward_ioctl: the real ioctl, or a wrapper timing it when
+ * profiling.  Both pointers start out at a resolver, for ioctls issued
+ * by constructors that run before ours, so no call has to check them. */
+static int
+dri2to3_resolve_ioctl(int fd, unsigned long request, ...);
+
+static typeof(ioctl) *orig_ioctl = dri2to3_resolve_ioctl;
+static typeof(ioctl) *forward_ioctl = dri2to3_resolve_ioctl;
+
+static int
+dri2to3_profile_ioctl(int fd, unsigned long request, ...)
+{
+        va_list args;
+        va_start(args, request);
+        void *ptr = va_arg(args, void *);
+        va_end(args);
+
+        uint64_t start = trace_now();
+        int ret = orig_ioctl(fd, request, ptr);
+
+        /* A dump from here must not clobber the ioctl's errno */
+        int err = errno;
+        profile_record(request, trace_now() - start);
+        errno = err;
+        return ret;
+}
+
+/* Runs after lib2to3_ctor, defined earlier, has read DRI2TO3_PROFILE */
+static void __attribute__((constructor))
+dri2to3_ioctl_init(void)
+{
+        orig_ioctl = dlsym(RTLD_NEXT, "ioctl");
+        forward_ioctl = profile_enabled ? dri2to3_profile_ioctl : orig_ioctl;
+}
+
+static int
+dri2to3_resolve_ioctl(int fd, unsigned long request, ...)
+{
         va_list args;
         va_start(args, request);
         void *ptr = va_arg(args, void *);
         va_end(args);
 
+        dri2to3_ioctl_init();
+        return orig_ioctl(fd, request, ptr);
+}
+
+static int
+drm_ioctl(int fd, unsigned long request, void *ptr)
+{
         if (request == DRM_IOCTL_GEM_OPEN) {
                 struct drm_gem_open *open = ptr;
 
                 LOG("MY DRM_IOCTL_GEM_OPEN %i\n", open->name);
 
                 open->handle = open->name;
-                open->size = lib2to3_get_handle_size(open->name);
+                open->size = lib2to3_get_handle_size(fd, open->name);
 
                 return 0;
         } else if (request == DRM_IOCTL_GEM_CLOSE) {
@@ -301,3 +709,29 @@ ioctl(int fd, unsigned long request, ...)
 
         return orig_ioctl(fd, request, ptr);
 }
+
+int
+ioctl(int fd, unsigned long request, ...)
+{
+        va_list args;
+        va_start(args, request);
+        void *ptr = va_arg(args, void *);
+        va_end(args);
+
+        /* Everything but DRM, e.g. the blob's job submission, goes
+         * straight through */
+        if (__builtin_expect(_IOC_TYPE(request) != DRM_IOCTL_BASE, true))
+                return forward_ioctl(fd, request, ptr);
+
+        if (__builtin_expect(profile_enabled, false)) {
+                uint64_t start = trace_now();
+                int ret = drm_ioctl(fd, request, ptr);
+
+                int err = errno;
+                profile_record(request, trace_now() - start);
+                errno = err;
+                return ret;
+        }
+
+        return drm_ioctl(fd, request, ptr);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DRI2TO3_INCLUDE_GUARD
+#define DRI2TO3_INCLUDE_GUARD
+
+/* Optional controls exported by libdri2to3.so.  Applications that are not
+ * linked against it can look these up with dlsym(RTLD_DEFAULT, ...). */
+
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+struct dri2to3_drawable_stats {
+        uint64_t frames;
+        uint64_t waits;
+
+        uint32_t buffers;
+        uint32_t max_buffers;
+        uint32_t grows;
+        uint32_t shrinks;
+
+        /* Waits for an idle buffer that hit the limit set with
+         * dri2to3_set_max_wait, and how many were resolved by allocating
+         * an extra buffer */
+        uint32_t timeouts;
+        uint32_t overallocs;
+};
+
+/* Set the swapchain depth of a drawable: 0 lets it adapt, otherwise the
+ * number of buffers to use.  Returns 0, or -1 for an unknown drawable. */
+int
+dri2to3_set_buffer_count(xcb_connection_t *conn, xcb_drawable_t drawable,
+                         unsigned count);
+
+/* Limit how long GetBuffers blocks waiting for the server to release a
+ * buffer, in milliseconds; 0 waits as long as needed.  Past the limit one
+ * extra buffer is allocated; when that one is still in use too,
+ * GetBuffers keeps waiting.  Returns 0, or -1 for an unknown drawable. */
+int
+dri2to3_set_max_wait(xcb_connection_t *conn, xcb_drawable_t drawable,
+                     unsigned ms);
+
+/* Add rectangles, in window coordinates, to the area that changed since the
+ * last swap.  Only the damaged area is then presented; without a call the
+ * whole window is.  Returns 0, or -1 for an unknown drawable. */
+int
+dri2to3_set_damage(xcb_connection_t *conn, xcb_drawable_t drawable,
+                   uint32_t n, const xcb_rectangle_t *rects);
+
+int
+dri2to3_get_drawable_stats(xcb_connection_t *conn, xcb_drawable_t drawable,
+                           struct dri2to3_drawable_stats *stats);
+
+#endif
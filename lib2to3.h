@@ -24,393 +24,2417 @@
 #ifndef LIB2TO3_INCLUDE_GUARD
 #define LIB2TO3_INCLUDE_GUARD
 
-#define MAX_BUFFERS 4
-
-//#define LOG(...) fprintf(stderr, __VA_ARGS__)
-#define LOG(...) do { break; fprintf(stderr, __VA_ARGS__); } while (0)
+#define MIN_BUFFERS 2
+#define MAX_BUFFERS 8
+
+/* With vsync, blocking on a busy buffer is just back-pressure, so an
+ * adaptive swapchain only grows past this when presenting async */
+#define MAX_BUFFERS_VSYNC 3
+
+/* An adaptive swapchain drops a buffer that stayed idle this many frames */
+#define BUFFER_IDLE_FRAMES 120
+
+/* Indexed by DRI2 attachment */
+#define NUM_ATTACHMENTS (XCB_DRI2_ATTACHMENT_BUFFER_HIZ + 1)
+
+/* The event thread sleeps until the connection is readable or it is woken
+ * through event_fd.  Another thread may read our events off the socket
+ * first, so a thread waiting for events looks, or has the event thread
+ * look, every EVENT_POLL_MS, and an idle event thread only looks every
+ * EVENT_THREAD_IDLE_MS. */
+#define EVENT_POLL_MS 4
+#define EVENT_THREAD_IDLE_MS 1000
+
+/* xshmfence_await cannot time out, so a wait for an idle fence checks it
+ * this often while watching the connection for events and errors */
+#define FENCE_POLL_MS 2
+
+/* Buffers a timed out wait may allocate past the swapchain size */
+#define MAX_BUFFERS_OVERALLOC 1
+
+/* Swap timestamps kept to measure swap to completion latency */
+#define SWAP_TIME_RING 16
+
+/* The drawable table never grows, so lookups walk chains of about
+ * drawables / DRAWABLE_HASH_SIZE.  A process has a handful of GL windows,
+ * rarely more than a few hundred; build with a larger value beyond that. */
+#ifndef DRAWABLE_HASH_BITS
+#define DRAWABLE_HASH_BITS 8
+#endif
+#define DRAWABLE_HASH_SIZE (1 << DRAWABLE_HASH_BITS)
 
 #include "list.h"
+#include "alloc.h"
+#include "stats.h"
+#include "trace.h"
+#include "profile.h"
+
+static bool debug_enabled;
+
+#define LOG(...) do { \
+                if (__builtin_expect(debug_enabled, false)) \
+                        fprintf(stderr, __VA_ARGS__); \
+        } while (0)
 
 static pthread_mutex_t l = PTHREAD_MUTEX_INITIALIZER;
 #define LOCK()   pthread_mutex_lock(&l)
 #define UNLOCK() pthread_mutex_unlock(&l)
 
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+#define HANDLE_LOCK()   pthread_mutex_lock(&handle_lock)
+#define HANDLE_UNLOCK() pthread_mutex_unlock(&handle_lock)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define POOL_LOCK()   pthread_mutex_lock(&pool_lock)
+#define POOL_UNLOCK() pthread_mutex_unlock(&pool_lock)
+
 static bool init_done = false;
-static struct list_head handle_list;
-static struct list_head close_list;
-static struct list_head drawable_list;
 
-struct handle_link {
-        struct list_head link;
+/* A GEM handle is shared between us and the client driver, which opens
+ * it again on every GetBuffers and closes it when done.  refs counts the
+ * outstanding closes: ours, and the client's while it was handed the
+ * buffer.  The real DRM_IOCTL_GEM_CLOSE is only issued once both sides
+ * have closed it. */
+struct gem_handle {
+        struct gem_handle *next_free;
+        int drm_fd;
         uint32_t handle;
         uint64_t size;
+        unsigned refs;
 };
 
-struct gem_close {
-        struct list_head link;
-        int drm_fd;
-        uint32_t handle;
-};
+#define HANDLE_SLAB_SIZE 64
+#define HANDLE_TABLE_MIN 64
+
+#define POOL_SIZE_DEFAULT (64ull << 20)
+
+static struct gem_handle **handle_table;
+static unsigned handle_table_size;
+static unsigned handle_table_count;
+static struct gem_handle *handle_free_list;
 
 struct buffer {
         struct list_head link;
+        xcb_connection_t *conn;
+        int drm_fd;
         xcb_pixmap_t pixmap;
         bool busy;
         bool dead;
 
+        struct gem_handle *gem;
+
         uint32_t handle;
         uint32_t pitch;
         uint32_t cpp;
+        uint32_t bpp;
+        uint32_t depth;
         uint32_t width, height;
         uint64_t size;
+        uint64_t modifier;
+
+        const struct allocator *alloc;
+        void *priv;
+
+        /* Serial of the last present, to ignore a stale IdleNotify */
+        uint32_t serial;
+
+#ifdef HAVE_XSHMFENCE
+        /* Triggered by the server once the buffer is idle again */
+        struct xshmfence *shm_fence;
+        xcb_sync_fence_t sync_fence;
+#endif
+
+        uint64_t last_used;
 };
 
-struct drawable {
+/* Idle buffers of destroyed or resized drawables, most recently used
+ * first.  Buffers keep their pixmap, so reusing one costs no requests. */
+static struct list_head buffer_pool = { &buffer_pool, &buffer_pool };
+static uint64_t pool_size;
+static uint64_t pool_max_size = POOL_SIZE_DEFAULT;
+
+static struct stats_shm *stats_shm;
+
+static const struct allocator *allocator = &alloc_dumb;
+
+/* Layouts the client driver can render to, from DRI2TO3_MODIFIERS.  A
+ * DRI2 buffer carries no modifier, so only linear is assumed to work. */
+#define MAX_MODIFIERS 16
+static uint64_t client_modifiers[MAX_MODIFIERS] = { DRM_FORMAT_MOD_LINEAR };
+static unsigned num_client_modifiers = 1;
+
+static unsigned default_swap_interval = 1;
+static unsigned default_buffer_count = 0;
+static bool event_thread_enabled;
+
+/* DRI2TO3_PREALLOC: fill the swapchain on creation and resize instead of
+ * on the first frames, inline or on a helper thread */
+enum prealloc_mode {
+        PREALLOC_OFF,
+        PREALLOC_INLINE,
+        PREALLOC_THREAD,
+};
+
+static enum prealloc_mode prealloc_mode;
+static uint64_t default_max_wait_ns;
+
+/* The modifiers both the server and the client accept for one format,
+ * in the client's order of preference */
+struct modifier_list {
+        struct modifier_list *next;
+        uint32_t depth, bpp;
+        unsigned num_modifiers;
+        uint64_t modifiers[];
+};
+
+/* Per xcb_connection_t state, created on the first DRI2 call */
+struct connection {
         struct list_head link;
+        xcb_connection_t *conn;
+
+        /* Opened once through DRI3 and used to find the device the
+         * server renders on */
+        int dri3_fd;
+        char device_name[64];
+
+        /* Extension versions, queried together on first use */
+        uint32_t dri3_major, dri3_minor;
+        uint32_t present_major, present_minor;
+
+        uint32_t xfixes_major, xfixes_minor;
+
+        /* DRI3 1.2: PixmapFromBuffers and format modifiers */
+        bool dri3_multiplane;
+        /* XFixes 2.0: regions, used for damage tracking */
+        bool has_regions;
+
+        /* Protects drawables, which the event thread walks */
+        pthread_mutex_t lock;
+        struct list_head drawables;
+
+        bool has_event_thread;
+        pthread_t event_thread;
+        atomic_bool stop;
+        int event_fd;
+};
+
+static void *
+lib2to3_event_thread(void *data);
+
+static struct list_head connection_list = { &connection_list, &connection_list };
+
+struct drawable {
+        _Atomic(struct drawable *) next;
+
+        /* One reference is held while the drawable is registered, one by
+         * each pending preallocation and one by each caller that looked it
+         * up.  The struct is only recycled once all are gone. */
+        atomic_uint refs;
+        bool destroyed;
+
+        /* In prealloc_jobs, under prealloc_lock */
+        struct list_head prealloc_link;
+        bool prealloc_queued;
+
+        /* Protects everything below conn/drawable; held across each
+         * GetBuffers, SwapBuffers and event dispatch for this drawable */
+        pthread_mutex_t lock;
 
+        struct connection *c;
         xcb_connection_t *conn;
         xcb_drawable_t drawable;
 
         int drm_fd;
 
+        uint32_t width, height;
+        uint32_t depth;
+
         xcb_present_event_t eid;
         xcb_special_event_t *special_event;
 
-        unsigned present_serial;
-        unsigned sbc;
+        /* Area changed since the last swap, passed to the server as the
+         * update region.  Without any damage the whole window is. */
+        xcb_xfixes_region_t damage;
+        bool has_damage;
+
+        /* SBC of the last swap sent and of the last one the server
+         * completed, with the UST/MSC it completed at */
+        uint64_t send_sbc;
+        uint64_t recv_sbc;
+        uint64_t ust, msc;
+
+        /* Serial of the last PresentNotifyMSC sent and completed */
+        uint32_t notify_serial;
+        uint32_t notify_recv_serial;
+        uint64_t notify_ust, notify_msc;
 
+        uint64_t wait_sbc;
+
+        unsigned swap_interval;
+
+        /* Longest GetBuffers waits for an idle buffer, 0 for no limit */
+        uint64_t max_wait_ns;
+
+        /* buffer_count is the configured depth, 0 when adaptive */
+        unsigned buffer_count;
+        unsigned max_buffers;
         unsigned num_buffers;
 
+        struct dri2to3_drawable_stats stats;
+
+        struct stats_drawable *shm_stats;
+        uint64_t bytes;
+        uint64_t last_swap_ns;
+        uint64_t swap_ns[SWAP_TIME_RING];
+
         struct buffer *cur;
         struct list_head buffers;
+
+        /* Present events read by the event thread, newest first, and a
+         * count of the batches it handled itself, signalled on cond */
+        _Atomic(struct pending_event *) pending;
+        uint64_t event_serial;
+        pthread_cond_t cond;
+
+        /* In c->drawables */
+        struct list_head conn_link;
+
+        /* Buffers for attachments other than the back buffer.  They are
+         * never presented, and are replaced when the window is resized. */
+        struct buffer *aux[NUM_ATTACHMENTS];
+
+        /* Attachments asked for by the last GetBuffers, for its reply */
+        uint32_t attachments[NUM_ATTACHMENTS];
+        unsigned num_attachments;
+
+        /* For copies between the window and its buffers, see lib2to3_get_gc */
+        xcb_gcontext_t gc;
+
+        /* Negotiated once per format, as the server may support other
+         * modifiers for each window */
+        struct modifier_list *modifiers;
 };
 
-static inline void
-lib2to3_init(void)
-{
-        LOCK();
-        if (!init_done) {
-                list_inithead(&handle_list);
-                list_inithead(&close_list);
-                list_inithead(&drawable_list);
-                init_done = true;
-        }
-        UNLOCK();
-}
+/* Drawables are looked up on every GetBuffers and SwapBuffers, so readers
+ * never take a lock.  Hash chains are validated against drawable_seq (odd
+ * while a writer is modifying them), and drawable structs are recycled
+ * through drawable_free_list instead of being freed, so a reader racing
+ * with a removal can never touch unmapped memory.  A reader takes a
+ * reference before locking the drawable, see lib2to3_lookup_drawable. */
+static _Atomic(struct drawable *) drawable_hash[DRAWABLE_HASH_SIZE];
+static struct drawable *drawable_free_list;
+static atomic_uint drawable_seq;
+
+static __thread struct {
+        xcb_connection_t *conn;
+        xcb_drawable_t drawable;
+        unsigned seq;
+        struct drawable *d;
+} drawable_cache;
 
 static inline void
-lib2to3_set_handle_size(uint32_t handle, uint64_t size)
+lib2to3_stats_init(void)
 {
-        struct handle_link *link = malloc(sizeof(*link));
-        *link = (struct handle_link) {
-                .handle = handle,
-                .size = size,
-        };
+        if (!getenv("DRI2TO3_STATS"))
+                return;
 
-        LOCK();
-        list_add(&link->link, &handle_list);
-        UNLOCK();
-}
+        char name[32];
+        snprintf(name, sizeof(name), STATS_NAME_FORMAT, getpid());
 
-static inline uint64_t
-lib2to3_get_handle_size(uint32_t handle)
-{
-        uint64_t size = 0;
+        int fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+        if (fd < 0)
+                return;
 
-        LOCK();
-        list_for_each_entry_safe(struct handle_link, h, &handle_list, link) {
-                if (h->handle == handle) {
-                        size = h->size;
-                        list_del(&h->link);
-                        free(h);
-                        break;
-                }
-        }
-        UNLOCK();
+        void *map = MAP_FAILED;
+        if (!ftruncate(fd, sizeof(*stats_shm)))
+                map = mmap(NULL, sizeof(*stats_shm), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        close(fd);
 
-        assert(size);
+        if (map == MAP_FAILED) {
+                shm_unlink(name);
+                return;
+        }
 
-        return size;
+        stats_shm = map;
+        stats_shm->version = STATS_VERSION;
+        stats_shm->pid = getpid();
+        strncpy(stats_shm->comm, program_invocation_short_name,
+                sizeof(stats_shm->comm) - 1);
+        __atomic_store_n(&stats_shm->magic, STATS_MAGIC, __ATOMIC_RELEASE);
 }
 
-static inline bool
-lib2to3_close_del_locked(int drm_fd, uint32_t handle)
+static void __attribute__((destructor))
+lib2to3_stats_fini(void)
 {
-        list_for_each_entry_safe(struct gem_close, c, &close_list, link) {
-                if ((c->drm_fd == drm_fd) && (c->handle == handle)) {
-                        list_del(&c->link);
-                        free(c);
-                        return true;
-                }
-        }
+        if (!stats_shm || (stats_shm->pid != getpid()))
+                return;
 
-        return false;
+        char name[32];
+        snprintf(name, sizeof(name), STATS_NAME_FORMAT, getpid());
+        shm_unlink(name);
 }
 
-static inline bool
-lib2to3_close_handle(int drm_fd, uint32_t handle)
+static inline struct stats_drawable *
+lib2to3_stats_claim(xcb_drawable_t drawable)
 {
-        LOCK();
-        if (lib2to3_close_del_locked(drm_fd, handle)) {
-                UNLOCK();
-                return true;
-        }
+        if (!stats_shm)
+                return NULL;
 
-        struct gem_close *c = malloc(sizeof(*c));
-        *c = (struct gem_close) {
-                .drm_fd = drm_fd,
-                .handle = handle,
-        };
-        list_addtail(&c->link, &close_list);
-        UNLOCK();
+        for (unsigned i = 0; i < STATS_MAX_DRAWABLES; ++i) {
+                struct stats_drawable *s = &stats_shm->drawables[i];
+                uint32_t free_slot = 0;
 
-        return false;
+                if (!__atomic_compare_exchange_n(&s->in_use, &free_slot, 1, false,
+                                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                        continue;
+
+                uint32_t generation = s->generation + 1;
+                memset((char *) s + offsetof(struct stats_drawable, drawable), 0,
+                       sizeof(*s) - offsetof(struct stats_drawable, drawable));
+                s->drawable = drawable;
+                __atomic_store_n(&s->generation, generation, __ATOMIC_RELEASE);
+                return s;
+        }
+
+        return NULL;
 }
 
 static inline void
-lib2to3_create_drawable(xcb_connection_t *conn, xcb_drawable_t drawable, int drm_fd)
+lib2to3_stats_release(struct stats_drawable *s)
 {
-        struct drawable *d = malloc(sizeof(*d));
-        *d = (struct drawable) {
-                .conn = conn,
-                .drawable = drawable,
-                .drm_fd = drm_fd,
-        };
-        list_inithead(&d->buffers);
+        if (s)
+                __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+}
 
-        d->eid = xcb_generate_id(d->conn);
+/* Copy the merged ioctl profile into the shared segment, at most once a
+ * second and by only one swapping thread at a time */
+static inline void
+lib2to3_stats_export_profile(uint64_t now)
+{
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        static uint64_t last_export_ns;
 
-        xcb_present_select_input(d->conn, d->eid, d->drawable,  
-                                 XCB_PRESENT_EVENT_MASK_CONFIGURE_NOTIFY |
-                                 XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);    
-        d->special_event =
-                xcb_register_for_special_xge(d->conn, &xcb_present_id,
-                                             d->eid, NULL);
+        if (!profile_enabled || (now - __atomic_load_n(&last_export_ns,
+                                                       __ATOMIC_RELAXED) < 1000000000ull))
+                return;
 
-        LOCK();
-        list_add(&d->link, &drawable_list);
-        UNLOCK();
-}
+        if (pthread_mutex_trylock(&lock))
+                return;
 
-static inline struct drawable *
-lib2to3_get_drawable(xcb_connection_t *conn, xcb_drawable_t drawable)
-{
-        LOCK();
-        list_for_each_entry(struct drawable, d, &drawable_list, link) {
-                if ((d->conn == conn) && (d->drawable == drawable)) {
-                        UNLOCK();
-                        return d;
-                }
+        if (now - last_export_ns >= 1000000000ull) {
+                profile_merge(stats_shm->ioctls);
+                __atomic_store_n(&last_export_ns, now, __ATOMIC_RELAXED);
         }
-        UNLOCK();
 
-        fprintf(stderr, "Could not find drawable %x!\n", drawable);
-        return NULL;
+        pthread_mutex_unlock(&lock);
 }
 
-static inline struct buffer *
-lib2to3_create_buffer(struct drawable *d)
+static inline void
+lib2to3_stats_swap(struct drawable *d)
 {
-        xcb_generic_error_t *error;
-        xcb_get_geometry_cookie_t geom_cookie =
-                xcb_get_geometry(d->conn, d->drawable);
+        struct stats_drawable *s = d->shm_stats;
+        if (!s)
+                return;
 
-        xcb_get_geometry_reply_t *geom =
-                xcb_get_geometry_reply(d->conn, geom_cookie, &error);
-
-        if (!geom)
-                return NULL;
+        uint64_t now = trace_now();
 
-        struct drm_mode_create_dumb create = {
-                .width = geom->width,
-                .height = geom->height,
-                .bpp = 32,
-        };
-        ioctl(d->drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create);
+        if (d->last_swap_ns)
+                stats_hist_add(&s->frame_time, now - d->last_swap_ns);
+        d->last_swap_ns = now;
+        d->swap_ns[d->send_sbc % SWAP_TIME_RING] = now;
 
-        struct drm_prime_handle handle = {
-                .handle = create.handle,
-        };
-        ioctl(d->drm_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &handle);
+        s->width = d->width;
+        s->height = d->height;
+        s->buffers = d->num_buffers;
+        s->max_buffers = d->max_buffers;
+        s->bytes = d->bytes;
+        s->frames = d->stats.frames;
 
-        xcb_pixmap_t pixmap = xcb_generate_id(d->conn);
+        lib2to3_stats_export_profile(now);
+}
 
-        xcb_dri3_pixmap_from_buffers(d->conn, pixmap, d->drawable, 1,
-                                     create.width, create.height,
-                                     create.pitch, 0,
-                                     0, 0, 0, 0, 0, 0,
-                                     geom->depth, 32, 0, &handle.fd);
+static inline void
+lib2to3_stats_complete(struct drawable *d, uint64_t ust)
+{
+        struct stats_drawable *s = d->shm_stats;
+        if (!s || (d->send_sbc - d->recv_sbc >= SWAP_TIME_RING))
+                return;
 
-        free(geom);
+        /* UST is CLOCK_MONOTONIC in microseconds */
+        uint64_t swap = d->swap_ns[d->recv_sbc % SWAP_TIME_RING];
+        uint64_t done = ust ? ust * 1000 : trace_now();
 
-        struct buffer *b = malloc(sizeof(*b));
-        *b = (struct buffer) {
-                .pixmap = pixmap,
-                .handle = create.handle,
-                .pitch = create.pitch,
-                .cpp = 4,
-                .width = create.width,
-                .height = create.height,
-                .size = create.size,
-        };
+        if (done > swap)
+                stats_hist_add(&s->present_latency, done - swap);
+}
 
-        ++d->num_buffers;
+static void __attribute__((constructor))
+lib2to3_ctor(void)
+{
+        debug_enabled = getenv("DRI2TO3_DEBUG") != NULL;
+        trace_init();
+        profile_init();
+        lib2to3_stats_init();
+}
 
-        return b;
+static inline unsigned
+lib2to3_handle_hash(int drm_fd, uint32_t handle)
+{
+        return ((uint32_t) drm_fd * 0x85ebca6bu) ^ (handle * 0x9e3779b1u);
 }
 
 static inline void
-lib2to3_free_buffer(struct drawable *d, struct buffer *b)
+lib2to3_handle_table_resize_locked(unsigned size)
 {
-        struct drm_gem_close close = {
-                .handle = b->handle,
-        };
-        ioctl(d->drm_fd, DRM_IOCTL_GEM_CLOSE, &close);
+        struct gem_handle **old = handle_table;
+        unsigned old_size = handle_table_size;
 
-        xcb_free_pixmap(d->conn, b->pixmap);
+        handle_table = calloc(size, sizeof(*handle_table));
+        handle_table_size = size;
 
-        free(b);
+        for (unsigned i = 0; i < old_size; ++i) {
+                struct gem_handle *h = old[i];
+                if (!h)
+                        continue;
 
-        --d->num_buffers;
+                unsigned j = lib2to3_handle_hash(h->drm_fd, h->handle);
+                while (handle_table[j & (size - 1)])
+                        ++j;
+                handle_table[j & (size - 1)] = h;
+        }
+
+        free(old);
 }
 
 static inline void
-lib2to3_handle_present_event(struct drawable *d,
-                             xcb_present_generic_event_t *ge)
+lib2to3_init(void)
 {
-        switch (ge->evtype) {
-        case XCB_PRESENT_CONFIGURE_NOTIFY: {
-                LOG("MY CONFIGURE_NOTIFY\n");
+        HANDLE_LOCK();
+        if (!init_done) {
+                lib2to3_handle_table_resize_locked(HANDLE_TABLE_MIN);
 
-                list_for_each_entry(struct buffer, b, &d->buffers, link) {
-                        b->dead = true;
-                }
-                break;
-        }
-        case XCB_PRESENT_EVENT_IDLE_NOTIFY: {
-                LOG("MY IDLE_NOTIFY\n");
+                const char *env = getenv("DRI2TO3_POOL_SIZE");
+                if (env)
+                        pool_max_size = strtoull(env, NULL, 0) << 20;
 
-                xcb_present_idle_notify_event_t *ie = (void *) ge;
+                env = getenv("DRI2TO3_SWAP_INTERVAL");
+                if (env)
+                        default_swap_interval = strtoul(env, NULL, 0);
 
-                list_for_each_entry(struct buffer, b, &d->buffers, link) {
-                        if (b->pixmap == ie->pixmap)
-                                b->busy = false;
+                env = getenv("DRI2TO3_BUFFERS");
+                if (env)
+                        default_buffer_count = strtoul(env, NULL, 0);
+
+                env = getenv("DRI2TO3_MAX_WAIT");
+                if (env)
+                        default_max_wait_ns = strtoull(env, NULL, 0) * 1000000;
+
+                env = getenv("DRI2TO3_PREALLOC");
+                if (env)
+                        prealloc_mode = strtoul(env, NULL, 0);
+
+                env = getenv("DRI2TO3_EVENT_THREAD");
+                if (env)
+                        event_thread_enabled = strtoul(env, NULL, 0);
+
+                env = getenv("DRI2TO3_ALLOCATOR");
+                if (env && !(allocator = alloc_find(env))) {
+                        fprintf(stderr, "dri2to3: unknown allocator %s\n", env);
+                        allocator = &alloc_dumb;
                 }
-                break;
-        }
-        default:
-                break;
-        }
 
-        list_for_each_entry_safe(struct buffer, b, &d->buffers, link) {
-                if (b->dead && !b->busy) {
-                        list_del(&b->link);
-                        lib2to3_free_buffer(d, b);
+                env = getenv("DRI2TO3_MODIFIERS");
+                if (env) {
+                        char *end;
+                        for (num_client_modifiers = 0;
+                             *env && (num_client_modifiers < MAX_MODIFIERS);
+                             env = *end ? end + 1 : end) {
+                                client_modifiers[num_client_modifiers++] =
+                                        strtoull(env, &end, 16);
+                        }
                 }
+
+                init_done = true;
         }
-        
-        free(ge);
+        HANDLE_UNLOCK();
 }
 
-static inline void
-lib2to3_flush_events(struct drawable *d)
+static inline unsigned
+lib2to3_handle_slot_locked(int drm_fd, uint32_t handle)
 {
-        xcb_generic_event_t *ev;
+        unsigned mask = handle_table_size - 1;
+        unsigned i = lib2to3_handle_hash(drm_fd, handle) & mask;
 
-        while ((ev = xcb_poll_for_special_event(d->conn,
-                                                d->special_event)) != NULL) {
-                xcb_present_generic_event_t *ge = (void *) ev;
-                lib2to3_handle_present_event(d, ge);
+        for (;; i = (i + 1) & mask) {
+                struct gem_handle *h = handle_table[i];
+                if (!h || ((h->drm_fd == drm_fd) && (h->handle == handle)))
+                        return i;
         }
 }
 
-static inline bool
-lib2to3_wait_for_event(struct drawable *d)
+static inline struct gem_handle *
+lib2to3_handle_alloc_locked(void)
 {
-        xcb_generic_event_t *ev;
-        ev = xcb_wait_for_special_event(d->conn, d->special_event);
-
-        if (!ev)
-                return false;
-
-        xcb_present_generic_event_t *ge = (void *) ev;
-
-        lib2to3_handle_present_event(d, ge);
-        return true;
-}
+        if (!handle_free_list) {
+                struct gem_handle *slab =
+                        calloc(HANDLE_SLAB_SIZE, sizeof(*slab));
 
-static inline struct buffer *
-lib2to3_set_buffer(struct drawable *d, struct buffer *b, bool reused)
-{
-        if (reused) {
-                LOCK();
-                lib2to3_close_del_locked(d->drm_fd, b->handle);
-                UNLOCK();
+                for (unsigned i = 0; i < HANDLE_SLAB_SIZE; ++i) {
+                        slab[i].next_free = handle_free_list;
+                        handle_free_list = &slab[i];
+                }
         }
 
-        d->cur = b;
-        return b;
+        struct gem_handle *h = handle_free_list;
+        handle_free_list = h->next_free;
+        return h;
 }
 
 static inline void
-lib2to3_drawable_swap(struct drawable *d)
+lib2to3_handle_remove_locked(unsigned i)
 {
-        d->cur->busy = true;
+        unsigned mask = handle_table_size - 1;
+
+        struct gem_handle *h = handle_table[i];
+        h->next_free = handle_free_list;
+        handle_free_list = h;
+        --handle_table_count;
+
+        /* Backward-shift deletion keeps probe sequences intact without
+         * tombstones */
+        for (unsigned j = (i + 1) & mask; handle_table[j]; j = (j + 1) & mask) {
+                struct gem_handle *n = handle_table[j];
+                unsigned k = lib2to3_handle_hash(n->drm_fd, n->handle) & mask;
+
+                if (((j - k) & mask) >= ((j - i) & mask)) {
+                        handle_table[i] = n;
+                        i = j;
+                }
+        }
 
-        list_addtail(&d->cur->link, &d->buffers);
-        d->cur = NULL;
+        handle_table[i] = NULL;
 }
 
-static inline struct buffer *
-lib2to3_get_buffer(struct drawable *d)
+static inline struct gem_handle *
+lib2to3_handle_add(int drm_fd, uint32_t handle, uint64_t size)
 {
-        if (d->cur)
-                return lib2to3_set_buffer(d, d->cur, true);
+        HANDLE_LOCK();
+        if ((handle_table_count + 1) * 2 > handle_table_size)
+                lib2to3_handle_table_resize_locked(handle_table_size * 2);
 
-        lib2to3_flush_events(d);
+        unsigned i = lib2to3_handle_slot_locked(drm_fd, handle);
+        struct gem_handle *h = handle_table[i];
 
-        for (;;) {
-                list_for_each_entry_safe(struct buffer, b, &d->buffers, link) {
-                        if (!b->busy) {
-                                list_del(&b->link);
-                                return lib2to3_set_buffer(d, b, true);
-                        }
-                }
+        if (!h) {
+                h = lib2to3_handle_alloc_locked();
+                handle_table[i] = h;
+                ++handle_table_count;
+        }
 
-                if (d->num_buffers < MAX_BUFFERS) {
-                        struct buffer *b = lib2to3_create_buffer(d);
-                        return lib2to3_set_buffer(d, b, false);
-                }
+        *h = (struct gem_handle) {
+                .drm_fd = drm_fd,
+                .handle = handle,
+                .size = size,
+                .refs = 1,
+        };
+        HANDLE_UNLOCK();
 
-                bool ret = lib2to3_wait_for_event(d);
-                if (!ret)
-                        return NULL;
-        }
+        return h;
 }
 
 static inline void
-lib2to3_free_drawable(xcb_connection_t *conn, xcb_drawable_t drawable)
+lib2to3_handle_reuse(struct gem_handle *h)
 {
-        LOCK();
-        list_for_each_entry_safe(struct drawable, d, &drawable_list, link) {
-                if ((d->conn == conn) && (d->drawable == drawable)) {
-                        list_del(&d->link);
-                        UNLOCK();
-
-                        list_for_each_entry_safe(struct buffer, b,
-                                                 &d->buffers, link) { 
-                                list_del(&b->link);
-                                lib2to3_free_buffer(d, b);
-                        }
+        HANDLE_LOCK();
+        h->refs = 2;
+        HANDLE_UNLOCK();
+}
 
-                        if (d->cur)
-                                lib2to3_free_buffer(d, d->cur);
+static inline uint64_t
+lib2to3_get_handle_size(int drm_fd, uint32_t handle)
+{
+        uint64_t size = 0;
 
-                        free(d);
+        HANDLE_LOCK();
+        struct gem_handle *h =
+                handle_table[lib2to3_handle_slot_locked(drm_fd, handle)];
+        if (h)
+                size = h->size;
+        HANDLE_UNLOCK();
 
-                        return;
-                }
-        }
-        UNLOCK();
+        assert(size);
+
+        return size;
+}
+
+static inline bool
+lib2to3_close_handle(int drm_fd, uint32_t handle)
+{
+        bool close = true;
+
+        HANDLE_LOCK();
+        unsigned i = lib2to3_handle_slot_locked(drm_fd, handle);
+        struct gem_handle *h = handle_table[i];
+
+        if (h) {
+                close = !--h->refs;
+                if (close)
+                        lib2to3_handle_remove_locked(i);
+        }
+        HANDLE_UNLOCK();
+
+        return close;
+}
+
+/* DRI2 clients authenticate and allocate dumb buffers, so they need the
+ * primary node rather than the render node DRI3 usually hands out */
+static inline bool
+lib2to3_device_name(int fd, char *name, size_t size)
+{
+        struct stat st;
+        if (fstat(fd, &st) || !S_ISCHR(st.st_mode))
+                return false;
+
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/drm",
+                 major(st.st_rdev), minor(st.st_rdev));
+
+        DIR *dir = opendir(path);
+        if (!dir)
+                return false;
+
+        bool found = false;
+        struct dirent *ent;
+        while (!found && (ent = readdir(dir))) {
+                if (!strncmp(ent->d_name, "card", 4)) {
+                        snprintf(name, size, "/dev/dri/%.32s", ent->d_name);
+                        found = true;
+                }
+        }
+        closedir(dir);
+
+        return found;
+}
+
+static inline struct connection *
+lib2to3_find_connection_locked(xcb_connection_t *conn)
+{
+        list_for_each_entry(struct connection, c, &connection_list, link) {
+                if (c->conn == conn)
+                        return c;
+        }
+
+        return NULL;
+}
+
+/* Returns NULL when the server can't do what DRI2 needs */
+static inline struct connection *
+lib2to3_get_connection(xcb_connection_t *conn, xcb_drawable_t drawable)
+{
+        LOCK();
+        struct connection *c = lib2to3_find_connection_locked(conn);
+        UNLOCK();
+
+        if (c)
+                return c;
+
+        c = malloc(sizeof(*c));
+        *c = (struct connection) {
+                .conn = conn,
+                .dri3_fd = -1,
+                .device_name = DEVICE_NAME,
+                .event_fd = -1,
+        };
+        pthread_mutex_init(&c->lock, NULL);
+        list_inithead(&c->drawables);
+
+        /* Pipeline every query so setup costs a single round trip */
+        xcb_dri3_query_version_cookie_t dri3_cookie =
+                xcb_dri3_query_version(conn, 1, 2);
+        xcb_present_query_version_cookie_t present_cookie =
+                xcb_present_query_version(conn, 1, 2);
+        xcb_xfixes_query_version_cookie_t xfixes_cookie =
+                xcb_xfixes_query_version(conn, 5, 0);
+        xcb_dri3_open_cookie_t open_cookie = xcb_dri3_open(conn, drawable, 0);
+
+        xcb_dri3_query_version_reply_t *dri3 =
+                xcb_dri3_query_version_reply(conn, dri3_cookie, NULL);
+        xcb_present_query_version_reply_t *present =
+                xcb_present_query_version_reply(conn, present_cookie, NULL);
+        xcb_xfixes_query_version_reply_t *xfixes =
+                xcb_xfixes_query_version_reply(conn, xfixes_cookie, NULL);
+        xcb_dri3_open_reply_t *open = xcb_dri3_open_reply(conn, open_cookie, NULL);
+
+        if (dri3) {
+                c->dri3_major = dri3->major_version;
+                c->dri3_minor = dri3->minor_version;
+                free(dri3);
+        }
+
+        if (present) {
+                c->present_major = present->major_version;
+                c->present_minor = present->minor_version;
+                free(present);
+        }
+
+        if (xfixes) {
+                c->xfixes_major = xfixes->major_version;
+                c->xfixes_minor = xfixes->minor_version;
+                free(xfixes);
+        }
+
+        c->dri3_multiplane = c->dri3_major > 1 ||
+                (c->dri3_major == 1 && c->dri3_minor >= 2);
+        c->has_regions = c->xfixes_major >= 2;
+
+        LOG("DRI3 version: %i.%i, Present version: %i.%i\n",
+            c->dri3_major, c->dri3_minor, c->present_major, c->present_minor);
+
+        if (open) {
+                if (open->nfd == 1)
+                        c->dri3_fd = xcb_dri3_open_reply_fds(conn, open)[0];
+                free(open);
+        }
+
+        if (c->dri3_fd >= 0) {
+                fcntl(c->dri3_fd, F_SETFD, FD_CLOEXEC);
+                lib2to3_device_name(c->dri3_fd, c->device_name,
+                                    sizeof(c->device_name));
+        }
+
+        LOG("DRI3 device %s fd %i\n", c->device_name, c->dri3_fd);
+
+        /* Every swap is a PresentPixmap and buffers come back through
+         * IdleNotify, all from Present 1.0, so nothing works without it */
+        if (c->present_major < 1) {
+                fprintf(stderr, "dri2to3: the X server lacks Present, "
+                        "DRI2 is unavailable\n");
+                if (c->dri3_fd >= 0)
+                        close(c->dri3_fd);
+                pthread_mutex_destroy(&c->lock);
+                free(c);
+                return NULL;
+        }
+
+        LOCK();
+        struct connection *other = lib2to3_find_connection_locked(conn);
+
+        /* Started before the connection is published, so that nobody else
+         * reads the special event queues once it can be found */
+        if (!other) {
+                if (event_thread_enabled) {
+                        c->event_fd = eventfd(0, EFD_CLOEXEC);
+                        c->has_event_thread = (c->event_fd >= 0) &&
+                                !pthread_create(&c->event_thread, NULL,
+                                                lib2to3_event_thread, c);
+                }
+
+                list_add(&c->link, &connection_list);
+        }
+        UNLOCK();
+
+        /* Lost a race with another thread setting up the same connection */
+        if (other) {
+                if (c->dri3_fd >= 0)
+                        close(c->dri3_fd);
+                pthread_mutex_destroy(&c->lock);
+                free(c);
+                return other;
+        }
+
+        return c;
+}
+
+static inline void
+lib2to3_free_drawable(xcb_connection_t *conn, xcb_drawable_t drawable);
+
+static inline void
+lib2to3_free_connection(xcb_connection_t *conn)
+{
+        LOCK();
+        struct connection *c = lib2to3_find_connection_locked(conn);
+        if (c)
+                list_del(&c->link);
+        UNLOCK();
+
+        if (!c)
+                return;
+
+        if (c->has_event_thread) {
+                atomic_store(&c->stop, true);
+                eventfd_write(c->event_fd, 1);
+                pthread_join(c->event_thread, NULL);
+        }
+
+        /* Drawables the client never destroyed would otherwise stay in
+         * the hash, and be found by a later connection at the same
+         * address */
+        pthread_mutex_lock(&c->lock);
+        while (!list_is_empty(&c->drawables)) {
+                struct drawable *d = list_first_entry(&c->drawables,
+                                                      struct drawable,
+                                                      conn_link);
+                xcb_drawable_t drawable = d->drawable;
+
+                pthread_mutex_unlock(&c->lock);
+                lib2to3_free_drawable(conn, drawable);
+                pthread_mutex_lock(&c->lock);
+        }
+        pthread_mutex_unlock(&c->lock);
+        if (c->event_fd >= 0)
+                close(c->event_fd);
+        pthread_mutex_destroy(&c->lock);
+
+        if (c->dri3_fd >= 0)
+                close(c->dri3_fd);
+        free(c);
+}
+
+/* Intersect the client's modifiers with those the server can use for the
+ * window.  An empty list means no modifier is known to work for both.
+ * Called with d->lock held. */
+static inline const struct modifier_list *
+lib2to3_get_modifiers(struct drawable *d, uint32_t depth, uint32_t bpp)
+{
+        struct modifier_list *m;
+
+        for (m = d->modifiers; m; m = m->next) {
+                if ((m->depth == depth) && (m->bpp == bpp))
+                        return m;
+        }
+
+        xcb_dri3_get_supported_modifiers_reply_t *reply = NULL;
+
+        if (d->c->dri3_multiplane) {
+                xcb_dri3_get_supported_modifiers_cookie_t cookie =
+                        xcb_dri3_get_supported_modifiers(d->conn, d->drawable,
+                                                         depth, bpp);
+                reply = xcb_dri3_get_supported_modifiers_reply(d->conn, cookie,
+                                                               NULL);
+        }
+
+        const uint64_t *server = NULL;
+        int num_server = 0;
+
+        if (reply) {
+                server = xcb_dri3_get_supported_modifiers_window_modifiers(reply);
+                num_server = xcb_dri3_get_supported_modifiers_window_modifiers_length(reply);
+
+                if (!num_server) {
+                        server = xcb_dri3_get_supported_modifiers_screen_modifiers(reply);
+                        num_server = xcb_dri3_get_supported_modifiers_screen_modifiers_length(reply);
+                }
+        }
+
+        m = malloc(sizeof(*m) + num_client_modifiers * sizeof(uint64_t));
+        *m = (struct modifier_list) {
+                .depth = depth,
+                .bpp = bpp,
+        };
+
+        for (unsigned i = 0; i < num_client_modifiers; ++i) {
+                for (int j = 0; j < num_server; ++j) {
+                        if (client_modifiers[i] == server[j]) {
+                                m->modifiers[m->num_modifiers++] = server[j];
+                                break;
+                        }
+                }
+        }
+
+        free(reply);
+
+        LOG("%u modifiers for drawable %x depth %u bpp %u\n",
+            m->num_modifiers, d->drawable, depth, bpp);
+
+        m->next = d->modifiers;
+        d->modifiers = m;
+
+        return m;
+}
+
+/* Whether a buffer with this modifier is what allocating for the list
+ * could have produced: without one, the allocators make linear buffers */
+static inline bool
+lib2to3_modifier_usable(const struct modifier_list *m, uint64_t modifier)
+{
+        if (!m || !m->num_modifiers)
+                return modifier == DRM_FORMAT_MOD_LINEAR;
+
+        for (unsigned i = 0; i < m->num_modifiers; ++i) {
+                if (m->modifiers[i] == modifier)
+                        return true;
+        }
+
+        return false;
+}
+
+static inline unsigned
+lib2to3_drawable_hash(xcb_connection_t *conn, xcb_drawable_t drawable)
+{
+        uint32_t h = (uint32_t) ((uintptr_t) conn >> 4) ^ drawable;
+        return (h * 0x9e3779b1u) >> (32 - DRAWABLE_HASH_BITS);
+}
+
+static inline void
+lib2to3_seq_write_begin_locked(void)
+{
+        atomic_fetch_add_explicit(&drawable_seq, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+}
+
+static inline void
+lib2to3_seq_write_end_locked(void)
+{
+        atomic_fetch_add_explicit(&drawable_seq, 1, memory_order_release);
+}
+
+static inline void
+lib2to3_set_buffer_count(struct drawable *d, unsigned count)
+{
+        if (count && (count < MIN_BUFFERS))
+                count = MIN_BUFFERS;
+        if (count > MAX_BUFFERS)
+                count = MAX_BUFFERS;
+
+        d->buffer_count = count;
+        d->max_buffers = count ? count : MIN_BUFFERS;
+}
+
+static inline void
+lib2to3_schedule_prealloc(struct drawable *d);
+
+static inline void
+lib2to3_create_drawable(struct connection *c, xcb_drawable_t drawable, int drm_fd)
+{
+        xcb_connection_t *conn = c->conn;
+
+        LOCK();
+        struct drawable *d = drawable_free_list;
+        if (d)
+                drawable_free_list = atomic_load_explicit(&d->next,
+                                                          memory_order_relaxed);
+        UNLOCK();
+
+        if (!d)
+                d = malloc(sizeof(*d));
+
+        struct drawable init = {
+                .refs = 1,
+                .c = c,
+                .conn = conn,
+                .drawable = drawable,
+                .drm_fd = drm_fd,
+                .swap_interval = default_swap_interval,
+                .max_wait_ns = default_max_wait_ns,
+        };
+
+        lib2to3_set_buffer_count(&init, default_buffer_count);
+
+        init.shm_stats = lib2to3_stats_claim(drawable);
+
+        init.eid = xcb_generate_id(conn);
+
+        xcb_present_select_input(conn, init.eid, drawable,
+                                 XCB_PRESENT_EVENT_MASK_CONFIGURE_NOTIFY |
+                                 XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY |
+                                 XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+        init.special_event =
+                xcb_register_for_special_xge(conn, &xcb_present_id,
+                                             init.eid, NULL);
+
+        /* Queried after selecting for ConfigureNotify, so that no resize
+         * can slip in between */
+        xcb_get_geometry_cookie_t geom_cookie =
+                xcb_get_geometry(conn, drawable);
+        xcb_get_geometry_reply_t *geom =
+                xcb_get_geometry_reply(conn, geom_cookie, NULL);
+
+        if (geom) {
+                init.width = geom->width;
+                init.height = geom->height;
+                init.depth = geom->depth;
+                free(geom);
+        }
+
+        _Atomic(struct drawable *) *bucket =
+                &drawable_hash[lib2to3_drawable_hash(conn, drawable)];
+
+        LOCK();
+        lib2to3_seq_write_begin_locked();
+        *d = init;
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_condattr_t cond_attr;
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&d->cond, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+        list_inithead(&d->buffers);
+        atomic_store_explicit(&d->next,
+                              atomic_load_explicit(bucket, memory_order_relaxed),
+                              memory_order_relaxed);
+        atomic_store_explicit(bucket, d, memory_order_release);
+        lib2to3_seq_write_end_locked();
+        UNLOCK();
+
+        pthread_mutex_lock(&c->lock);
+        list_addtail(&d->conn_link, &c->drawables);
+        pthread_mutex_unlock(&c->lock);
+
+        if (prealloc_mode) {
+                pthread_mutex_lock(&d->lock);
+                lib2to3_schedule_prealloc(d);
+                pthread_mutex_unlock(&d->lock);
+        }
+}
+
+/* Takes a reference unless the last one is already gone, in which case
+ * the struct is on its way to drawable_free_list */
+static inline bool
+lib2to3_drawable_tryref(struct drawable *d)
+{
+        unsigned refs = atomic_load_explicit(&d->refs, memory_order_relaxed);
+
+        do {
+                if (!refs)
+                        return false;
+        } while (!atomic_compare_exchange_weak_explicit(&d->refs, &refs,
+                                                        refs + 1,
+                                                        memory_order_acquire,
+                                                        memory_order_relaxed));
+        return true;
+}
+
+static inline void
+lib2to3_drawable_unref(struct drawable *d);
+
+/* Returns the drawable with a reference held, so it can't be recycled
+ * before the caller locks it.  A drawable still in the table has the
+ * table's reference, so when drawable_seq did not change around taking
+ * ours, the struct was that drawable all along. */
+static inline struct drawable *
+lib2to3_lookup_drawable(xcb_connection_t *conn, xcb_drawable_t drawable)
+{
+        _Atomic(struct drawable *) *bucket =
+                &drawable_hash[lib2to3_drawable_hash(conn, drawable)];
+
+        for (;;) {
+                unsigned seq = atomic_load_explicit(&drawable_seq,
+                                                    memory_order_acquire);
+                if (seq & 1)
+                        continue;
+
+                struct drawable *found = NULL;
+
+                if ((drawable_cache.seq == seq) &&
+                    (drawable_cache.conn == conn) &&
+                    (drawable_cache.drawable == drawable)) {
+                        found = drawable_cache.d;
+                } else {
+                        for (struct drawable *d = atomic_load_explicit(bucket, memory_order_acquire);
+                             d; d = atomic_load_explicit(&d->next, memory_order_acquire)) {
+                                if ((d->conn == conn) && (d->drawable == drawable)) {
+                                        found = d;
+                                        break;
+                                }
+                        }
+                }
+
+                if (found && !lib2to3_drawable_tryref(found))
+                        continue;
+
+                atomic_thread_fence(memory_order_acquire);
+                if (atomic_load_explicit(&drawable_seq, memory_order_relaxed) == seq) {
+                        drawable_cache.conn = conn;
+                        drawable_cache.drawable = drawable;
+                        drawable_cache.seq = seq;
+                        drawable_cache.d = found;
+                        return found;
+                }
+
+                if (found)
+                        lib2to3_drawable_unref(found);
+        }
+}
+
+/* Returns the drawable locked, or NULL if it is unknown or being
+ * destroyed.  Release it with lib2to3_unlock_drawable. */
+static inline struct drawable *
+lib2to3_lock_drawable(xcb_connection_t *conn, xcb_drawable_t drawable)
+{
+        struct drawable *d = lib2to3_lookup_drawable(conn, drawable);
+
+        if (d) {
+                pthread_mutex_lock(&d->lock);
+                if (!d->destroyed)
+                        return d;
+
+                pthread_mutex_unlock(&d->lock);
+                lib2to3_drawable_unref(d);
+        }
+
+        fprintf(stderr, "Could not find drawable %x!\n", drawable);
+        return NULL;
+}
+
+static inline void
+lib2to3_unlock_drawable(struct drawable *d)
+{
+        pthread_mutex_unlock(&d->lock);
+        lib2to3_drawable_unref(d);
+}
+
+#ifdef HAVE_XSHMFENCE
+/* The server triggers the fence once the buffer is idle after a present */
+static inline void
+lib2to3_create_fence(struct buffer *b)
+{
+        int fence_fd = xshmfence_alloc_shm();
+        if (fence_fd < 0)
+                return;
+
+        b->shm_fence = xshmfence_map_shm(fence_fd);
+        if (!b->shm_fence) {
+                close(fence_fd);
+                return;
+        }
+
+        b->sync_fence = xcb_generate_id(b->conn);
+        xcb_dri3_fence_from_fd(b->conn, b->pixmap, b->sync_fence,
+                               false, fence_fd);
+}
+#endif
+
+static inline void
+lib2to3_destroy_fence(struct buffer *b)
+{
+#ifdef HAVE_XSHMFENCE
+        if (b->shm_fence) {
+                xcb_sync_destroy_fence(b->conn, b->sync_fence);
+                xshmfence_unmap_shm(b->shm_fence);
+                b->shm_fence = NULL;
+        }
+#endif
+}
+
+static inline void
+lib2to3_destroy_buffer(struct buffer *b)
+{
+        struct alloc_bo bo = {
+                .handle = b->handle,
+                .priv = b->priv,
+        };
+        b->alloc->destroy(b->drm_fd, &bo);
+
+        xcb_free_pixmap(b->conn, b->pixmap);
+
+        lib2to3_destroy_fence(b);
+
+        free(b);
+}
+
+static inline void
+lib2to3_pool_put(struct buffer *b)
+{
+        struct list_head evicted;
+        list_inithead(&evicted);
+
+        POOL_LOCK();
+        list_add(&b->link, &buffer_pool);
+        pool_size += b->size;
+
+        while (pool_size > pool_max_size) {
+                struct buffer *lru =
+                        list_last_entry(&buffer_pool, struct buffer, link);
+                list_del(&lru->link);
+                pool_size -= lru->size;
+                list_addtail(&lru->link, &evicted);
+        }
+        POOL_UNLOCK();
+
+        list_for_each_entry_safe(struct buffer, e, &evicted, link)
+                lib2to3_destroy_buffer(e);
+}
+
+/* A pooled buffer must also match what the drawable would allocate now,
+ * as buffers of another window may have a layout this one can't use */
+static inline struct buffer *
+lib2to3_pool_get(struct drawable *d, uint32_t width, uint32_t height,
+                 uint32_t bpp, uint32_t depth,
+                 const struct allocator *alloc, const struct modifier_list *m)
+{
+        POOL_LOCK();
+        list_for_each_entry(struct buffer, b, &buffer_pool, link) {
+                if ((b->conn == d->conn) && (b->drm_fd == d->drm_fd) &&
+                    (b->width == width) && (b->height == height) &&
+                    (b->bpp == bpp) && (b->depth == depth) &&
+                    (b->alloc == alloc) &&
+                    lib2to3_modifier_usable(m, b->modifier)) {
+                        list_del(&b->link);
+                        pool_size -= b->size;
+                        POOL_UNLOCK();
+
+                        b->busy = false;
+                        b->dead = false;
+                        return b;
+                }
+        }
+        POOL_UNLOCK();
+
+        return NULL;
+}
+
+static inline void
+lib2to3_pool_drop_conn(xcb_connection_t *conn)
+{
+        struct list_head dropped;
+        list_inithead(&dropped);
+
+        POOL_LOCK();
+        list_for_each_entry_safe(struct buffer, b, &buffer_pool, link) {
+                if (b->conn == conn) {
+                        list_del(&b->link);
+                        pool_size -= b->size;
+                        list_addtail(&b->link, &dropped);
+                }
+        }
+        POOL_UNLOCK();
+
+        list_for_each_entry_safe(struct buffer, b, &dropped, link)
+                lib2to3_destroy_buffer(b);
+}
+
+/* Bits per pixel of the dumb buffer backing a pixmap of this depth */
+static inline uint32_t
+lib2to3_depth_bpp(uint32_t depth)
+{
+        if (depth <= 8)
+                return 8;
+        if (depth <= 16)
+                return 16;
+        return 32;
+}
+
+static inline struct buffer *
+lib2to3_create_buffer_depth(struct drawable *d, uint32_t depth)
+{
+        if (!d->width || !d->height)
+                return NULL;
+
+        uint32_t bpp = lib2to3_depth_bpp(depth);
+
+        const struct allocator *alloc = allocator;
+        const struct modifier_list *m = NULL;
+
+        if (alloc->modifiers)
+                m = lib2to3_get_modifiers(d, depth, bpp);
+
+        struct buffer *b = lib2to3_pool_get(d, d->width, d->height,
+                                            bpp, depth, alloc, m);
+        if (b) {
+                ++d->num_buffers;
+                d->bytes += b->size;
+                return b;
+        }
+
+        struct alloc_bo bo;
+
+        if (!alloc->create(d->drm_fd, d->width, d->height, depth, bpp,
+                           m ? m->modifiers : NULL, m ? m->num_modifiers : 0,
+                           &bo)) {
+                if (alloc == &alloc_dumb)
+                        return NULL;
+
+                LOG("%s allocation failed, falling back to dumb\n", alloc->name);
+
+                alloc = &alloc_dumb;
+                if (!alloc->create(d->drm_fd, d->width, d->height, depth, bpp,
+                                   NULL, 0, &bo))
+                        return NULL;
+        }
+
+        xcb_pixmap_t pixmap = xcb_generate_id(d->conn);
+
+        if (d->c->dri3_multiplane)
+                xcb_dri3_pixmap_from_buffers(d->conn, pixmap, d->drawable, 1,
+                                             d->width, d->height,
+                                             bo.pitch, 0,
+                                             0, 0, 0, 0, 0, 0,
+                                             depth, bpp, bo.modifier, &bo.fd);
+        else
+                xcb_dri3_pixmap_from_buffer(d->conn, pixmap, d->drawable,
+                                            bo.size, d->width,
+                                            d->height, bo.pitch,
+                                            depth, bpp, bo.fd);
+
+        b = malloc(sizeof(*b));
+        *b = (struct buffer) {
+                .conn = d->conn,
+                .drm_fd = d->drm_fd,
+                .pixmap = pixmap,
+                .handle = bo.handle,
+                .pitch = bo.pitch,
+                .cpp = bpp / 8,
+                .bpp = bpp,
+                .depth = depth,
+                .width = d->width,
+                .height = d->height,
+                .size = bo.size,
+                .modifier = bo.modifier,
+                .alloc = alloc,
+                .priv = bo.priv,
+        };
+
+#ifdef HAVE_XSHMFENCE
+        lib2to3_create_fence(b);
+#endif
+
+        b->gem = lib2to3_handle_add(d->drm_fd, b->handle, b->size);
+
+        ++d->num_buffers;
+        d->bytes += b->size;
+
+        TRACE(TRACE_ALLOC, d->drawable, b->size);
+
+        return b;
+}
+
+static inline struct buffer *
+lib2to3_create_buffer(struct drawable *d)
+{
+        return lib2to3_create_buffer_depth(d, d->depth);
+}
+
+static inline void
+lib2to3_free_buffer(struct drawable *d, struct buffer *b)
+{
+        TRACE(TRACE_FREE, d->drawable, b->size);
+
+        --d->num_buffers;
+        d->bytes -= b->size;
+
+        /* A busy buffer may still be read by the server, and its
+         * IdleNotify would go to a drawable that no longer tracks it */
+        if (b->busy || !pool_max_size)
+                lib2to3_destroy_buffer(b);
+        else
+                lib2to3_pool_put(b);
+}
+
+static inline void
+lib2to3_drawable_unref(struct drawable *d)
+{
+        if (atomic_fetch_sub(&d->refs, 1) != 1)
+                return;
+
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->cond);
+
+        LOCK();
+        lib2to3_seq_write_begin_locked();
+        d->conn = NULL;
+        d->drawable = 0;
+        atomic_store_explicit(&d->next, drawable_free_list, memory_order_relaxed);
+        lib2to3_seq_write_end_locked();
+        drawable_free_list = d;
+        UNLOCK();
+}
+
+/* Swapchain buffers that can be handed out again.  Dead ones only wait
+ * for the server to release them, and a cur of the old size is dropped by
+ * the next GetBuffers. */
+static inline unsigned
+lib2to3_live_buffers(struct drawable *d)
+{
+        unsigned live = d->num_buffers;
+
+        list_for_each_entry(struct buffer, b, &d->buffers, link) {
+                if (b->dead)
+                        --live;
+        }
+
+        if (d->cur && ((d->cur->width != d->width) ||
+                       (d->cur->height != d->height)))
+                --live;
+
+        return live;
+}
+
+/* Allocate idle buffers until the swapchain is full, so the first frames
+ * after creation or a resize don't each pay for an allocation */
+static inline void
+lib2to3_prealloc_buffers(struct drawable *d)
+{
+        for (unsigned live = lib2to3_live_buffers(d);
+             live < d->max_buffers; ++live) {
+                struct buffer *b = lib2to3_create_buffer(d);
+                if (!b)
+                        break;
+
+                b->last_used = d->send_sbc;
+                list_add(&b->link, &d->buffers);
+        }
+}
+
+static pthread_mutex_t prealloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prealloc_cond = PTHREAD_COND_INITIALIZER;
+static struct list_head prealloc_jobs = { &prealloc_jobs, &prealloc_jobs };
+static bool prealloc_thread_started;
+
+static void *
+lib2to3_prealloc_thread(void *data)
+{
+        for (;;) {
+                pthread_mutex_lock(&prealloc_lock);
+                while (list_is_empty(&prealloc_jobs))
+                        pthread_cond_wait(&prealloc_cond, &prealloc_lock);
+
+                struct drawable *d = list_first_entry(&prealloc_jobs,
+                                                      struct drawable,
+                                                      prealloc_link);
+                list_del(&d->prealloc_link);
+                d->prealloc_queued = false;
+                pthread_mutex_unlock(&prealloc_lock);
+
+                pthread_mutex_lock(&d->lock);
+                if (!d->destroyed)
+                        lib2to3_prealloc_buffers(d);
+                pthread_mutex_unlock(&d->lock);
+
+                lib2to3_drawable_unref(d);
+        }
+
+        return NULL;
+}
+
+/* Called with d->lock held.  A drawable is queued at most once, so a burst
+ * of resizes only allocates for the size current when the job runs. */
+static inline void
+lib2to3_schedule_prealloc(struct drawable *d)
+{
+        if (prealloc_mode == PREALLOC_INLINE)
+                lib2to3_prealloc_buffers(d);
+
+        if (prealloc_mode != PREALLOC_THREAD)
+                return;
+
+        pthread_mutex_lock(&prealloc_lock);
+        if (!prealloc_thread_started) {
+                pthread_t thread;
+                prealloc_thread_started =
+                        !pthread_create(&thread, NULL,
+                                        lib2to3_prealloc_thread, NULL);
+                if (prealloc_thread_started)
+                        pthread_detach(thread);
+        }
+
+        if (prealloc_thread_started && !d->prealloc_queued) {
+                atomic_fetch_add(&d->refs, 1);
+                d->prealloc_queued = true;
+                list_addtail(&d->prealloc_link, &prealloc_jobs);
+                pthread_cond_signal(&prealloc_cond);
+        }
+        pthread_mutex_unlock(&prealloc_lock);
+}
+
+static inline void
+lib2to3_handle_present_event(struct drawable *d,
+                             xcb_present_generic_event_t *ge)
+{
+        switch (ge->evtype) {
+        case XCB_PRESENT_CONFIGURE_NOTIFY: {
+                LOG("MY CONFIGURE_NOTIFY\n");
+
+                xcb_present_configure_notify_event_t *ce = (void *) ge;
+
+                TRACE(TRACE_CONFIGURE, d->drawable,
+                      ((uint64_t) ce->width << 32) | ce->height);
+
+                if ((ce->width == d->width) && (ce->height == d->height))
+                        break;
+
+                d->width = ce->width;
+                d->height = ce->height;
+
+                list_for_each_entry(struct buffer, b, &d->buffers, link) {
+                        b->dead = true;
+                }
+
+                lib2to3_schedule_prealloc(d);
+                break;
+        }
+        case XCB_PRESENT_EVENT_COMPLETE_NOTIFY: {
+                LOG("MY COMPLETE_NOTIFY\n");
+
+                xcb_present_complete_notify_event_t *ce = (void *) ge;
+
+                TRACE(TRACE_COMPLETE, d->drawable, ce->msc);
+
+                if (ce->kind == XCB_PRESENT_COMPLETE_KIND_PIXMAP) {
+                        /* Extend the 32-bit serial back to the SBC */
+                        d->recv_sbc = d->send_sbc -
+                                (uint32_t) (d->send_sbc - ce->serial);
+                        d->ust = ce->ust;
+                        d->msc = ce->msc;
+
+                        lib2to3_stats_complete(d, ce->ust);
+                } else {
+                        d->notify_recv_serial = ce->serial;
+                        d->notify_ust = ce->ust;
+                        d->notify_msc = ce->msc;
+                }
+                break;
+        }
+        case XCB_PRESENT_EVENT_IDLE_NOTIFY: {
+                LOG("MY IDLE_NOTIFY\n");
+
+                xcb_present_idle_notify_event_t *ie = (void *) ge;
+
+                TRACE(TRACE_IDLE, d->drawable, ie->serial);
+
+                /* With fences the buffer may have been found idle and
+                 * presented again before this arrives */
+                list_for_each_entry(struct buffer, b, &d->buffers, link) {
+                        if ((b->pixmap == ie->pixmap) &&
+                            (b->serial == ie->serial))
+                                b->busy = false;
+                }
+                break;
+        }
+        default:
+                break;
+        }
+
+        list_for_each_entry_safe(struct buffer, b, &d->buffers, link) {
+                if (b->dead && !b->busy) {
+                        list_del(&b->link);
+                        lib2to3_free_buffer(d, b);
+                }
+        }
+        
+        free(ge);
+}
+
+struct pending_event {
+        struct pending_event *next;
+        xcb_generic_event_t *ev;
+};
+
+static inline void
+lib2to3_handle_pending_events(struct drawable *d)
+{
+        struct pending_event *p =
+                atomic_exchange_explicit(&d->pending, NULL,
+                                         memory_order_acquire);
+
+        /* Reverse, to handle them in the order they arrived */
+        struct pending_event *list = NULL;
+        while (p) {
+                struct pending_event *next = p->next;
+                p->next = list;
+                list = p;
+                p = next;
+        }
+
+        while (list) {
+                struct pending_event *next = list->next;
+                lib2to3_handle_present_event(d, (void *) list->ev);
+                free(list);
+                list = next;
+        }
+}
+
+/* Called by the event thread with c->lock held.  The events are handed over
+ * without blocking: when the drawable is busy, whoever holds its lock
+ * picks them up, or the next wakeup tries again. */
+static inline void
+lib2to3_queue_events(struct drawable *d)
+{
+        xcb_generic_event_t *ev;
+
+        while ((ev = xcb_poll_for_special_event(d->conn,
+                                                d->special_event)) != NULL) {
+                struct pending_event *p = malloc(sizeof(*p));
+                p->ev = ev;
+                p->next = atomic_load_explicit(&d->pending,
+                                               memory_order_relaxed);
+                while (!atomic_compare_exchange_weak_explicit(&d->pending,
+                                                              &p->next, p,
+                                                              memory_order_release,
+                                                              memory_order_relaxed))
+                        ;
+        }
+
+        if (!atomic_load_explicit(&d->pending, memory_order_relaxed))
+                return;
+
+        if (pthread_mutex_trylock(&d->lock))
+                return;
+
+        lib2to3_handle_pending_events(d);
+        ++d->event_serial;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+}
+
+static void *
+lib2to3_event_thread(void *data)
+{
+        struct connection *c = data;
+
+        struct pollfd fds[] = {
+                { .fd = xcb_get_file_descriptor(c->conn), .events = POLLIN },
+                { .fd = c->event_fd, .events = POLLIN },
+        };
+
+        while (!atomic_load(&c->stop) && !xcb_connection_has_error(c->conn)) {
+                poll(fds, 2, EVENT_THREAD_IDLE_MS);
+
+                eventfd_t count;
+                if (fds[1].revents & POLLIN)
+                        eventfd_read(c->event_fd, &count);
+
+                pthread_mutex_lock(&c->lock);
+                list_for_each_entry(struct drawable, d, &c->drawables, conn_link)
+                        lib2to3_queue_events(d);
+                pthread_mutex_unlock(&c->lock);
+        }
+
+        return NULL;
+}
+
+/* Called with d->lock held while waiting for the event thread to hand
+ * over events.  Has it look at the queues, in case another thread read
+ * them off the socket, then sleeps for EVENT_POLL_MS at most. */
+static inline void
+lib2to3_event_thread_wait(struct drawable *d, uint64_t deadline)
+{
+        uint64_t timeout = trace_now() + EVENT_POLL_MS * 1000000ull;
+        if (deadline && (deadline < timeout))
+                timeout = deadline;
+
+        struct timespec ts = {
+                .tv_sec = timeout / 1000000000,
+                .tv_nsec = timeout % 1000000000,
+        };
+
+        eventfd_write(d->c->event_fd, 1);
+        pthread_cond_timedwait(&d->cond, &d->lock, &ts);
+}
+
+static inline void
+lib2to3_flush_events(struct drawable *d)
+{
+        xcb_generic_event_t *ev;
+
+        /* The event thread only reads the queue under c->lock, so once we
+         * hold it, everything it took out is in d->pending and handling
+         * that first keeps the events in order.  The event thread never
+         * blocks on d->lock while holding c->lock. */
+        if (d->c->has_event_thread)
+                pthread_mutex_lock(&d->c->lock);
+
+        lib2to3_handle_pending_events(d);
+
+        bool handled = false;
+        while ((ev = xcb_poll_for_special_event(d->conn,
+                                                d->special_event)) != NULL) {
+                xcb_present_generic_event_t *ge = (void *) ev;
+                lib2to3_handle_present_event(d, ge);
+                handled = true;
+        }
+
+        if (d->c->has_event_thread) {
+                pthread_mutex_unlock(&d->c->lock);
+
+                /* Other threads waiting on this drawable expect the event
+                 * thread to have woken them */
+                if (handled) {
+                        ++d->event_serial;
+                        pthread_cond_broadcast(&d->cond);
+                }
+        }
+}
+
+static inline bool
+lib2to3_wait_for_event(struct drawable *d)
+{
+        xcb_generic_event_t *ev;
+
+        if (d->c->has_event_thread) {
+                uint64_t serial = d->event_serial;
+
+                TRACE_BEGIN(TRACE_WAIT, d->drawable);
+                while (!atomic_load_explicit(&d->pending, memory_order_relaxed) &&
+                       (d->event_serial == serial)) {
+                        if (xcb_connection_has_error(d->conn)) {
+                                TRACE_END(TRACE_WAIT, d->drawable);
+                                return false;
+                        }
+
+                        lib2to3_event_thread_wait(d, 0);
+                }
+                TRACE_END(TRACE_WAIT, d->drawable);
+
+                lib2to3_handle_pending_events(d);
+                return true;
+        }
+
+        TRACE_BEGIN(TRACE_WAIT, d->drawable);
+        ev = xcb_wait_for_special_event(d->conn, d->special_event);
+        TRACE_END(TRACE_WAIT, d->drawable);
+
+        if (!ev)
+                return false;
+
+        xcb_present_generic_event_t *ge = (void *) ev;
+
+        lib2to3_handle_present_event(d, ge);
+        return true;
+}
+
+/* Only a buffer handed to the client gets its reference: one created
+ * or prefetched and then dropped by a resize was never opened there */
+static inline struct buffer *
+lib2to3_set_buffer(struct drawable *d, struct buffer *b)
+{
+        if (b)
+                lib2to3_handle_reuse(b->gem);
+
+        d->cur = b;
+        return b;
+}
+
+static inline void
+lib2to3_drawable_swap(struct drawable *d)
+{
+        d->cur->busy = true;
+        d->cur->serial = (uint32_t) d->send_sbc;
+        d->cur->last_used = d->send_sbc;
+
+        list_addtail(&d->cur->link, &d->buffers);
+        d->cur = NULL;
+
+        ++d->stats.frames;
+
+        lib2to3_stats_swap(d);
+}
+
+/* Like lib2to3_wait_for_event, but gives up at deadline (CLOCK_MONOTONIC
+ * ns).  Returns false on timeout or connection error. */
+static inline bool
+lib2to3_wait_for_event_until(struct drawable *d, uint64_t deadline)
+{
+        bool ret = false;
+
+        TRACE_BEGIN(TRACE_WAIT, d->drawable);
+
+        if (d->c->has_event_thread) {
+                uint64_t serial = d->event_serial;
+
+                while (!atomic_load_explicit(&d->pending, memory_order_relaxed) &&
+                       (d->event_serial == serial) &&
+                       !xcb_connection_has_error(d->conn) &&
+                       (trace_now() < deadline))
+                        lib2to3_event_thread_wait(d, deadline);
+
+                ret = atomic_load_explicit(&d->pending, memory_order_relaxed) ||
+                        (d->event_serial != serial);
+                lib2to3_handle_pending_events(d);
+        } else {
+                struct pollfd fd = {
+                        .fd = xcb_get_file_descriptor(d->conn),
+                        .events = POLLIN,
+                };
+
+                /* Another thread may read the event off the socket, so
+                 * don't rely on the poll alone */
+                for (;;) {
+                        xcb_generic_event_t *ev =
+                                xcb_poll_for_special_event(d->conn,
+                                                           d->special_event);
+                        if (ev) {
+                                lib2to3_handle_present_event(d, (void *) ev);
+                                ret = true;
+                                break;
+                        }
+
+                        uint64_t now = trace_now();
+                        if ((now >= deadline) ||
+                            xcb_connection_has_error(d->conn))
+                                break;
+
+                        uint64_t timeout = (deadline - now + 999999) / 1000000;
+                        poll(&fd, 1, timeout < EVENT_POLL_MS ?
+                             timeout : EVENT_POLL_MS);
+                }
+        }
+
+        TRACE_END(TRACE_WAIT, d->drawable);
+
+        return ret;
+}
+
+/* The server triggers the idle fence as it sends IdleNotify, so checking
+ * it saves waiting for the event to be read */
+static inline bool
+lib2to3_buffer_idle(struct buffer *b)
+{
+#ifdef HAVE_XSHMFENCE
+        if (b->busy && b->shm_fence && xshmfence_query(b->shm_fence))
+                b->busy = false;
+#endif
+
+        return !b->busy;
+}
+
+/* Block until the oldest busy buffer is idle or an event arrives, or just
+ * for the next event when there are no fences.  Returns false on a
+ * connection error. */
+static inline bool
+lib2to3_wait_for_buffer(struct drawable *d)
+{
+#ifdef HAVE_XSHMFENCE
+        list_for_each_entry(struct buffer, b, &d->buffers, link) {
+                if (!b->busy || b->dead)
+                        continue;
+
+                if (!b->shm_fence)
+                        break;
+
+                /* Any event may have freed b, so the caller looks again */
+                while (!xshmfence_query(b->shm_fence)) {
+                        if (xcb_connection_has_error(d->conn))
+                                return false;
+
+                        if (lib2to3_wait_for_event_until(d, trace_now() +
+                                                         FENCE_POLL_MS * 1000000ull))
+                                break;
+                }
+
+                return true;
+        }
+#endif
+
+        return lib2to3_wait_for_event(d);
+}
+
+/* Takes the most recently used idle buffer, so that surplus buffers age
+ * and can be released by lib2to3_trim_buffers */
+static inline struct buffer *
+lib2to3_take_idle_buffer(struct drawable *d)
+{
+        list_for_each_entry_safe_rev(struct buffer, b, &d->buffers, link) {
+                if (!lib2to3_buffer_idle(b))
+                        continue;
+
+                list_del(&b->link);
+
+                /* Only possible when the fence beat IdleNotify */
+                if (b->dead) {
+                        lib2to3_free_buffer(d, b);
+                        continue;
+                }
+
+                return b;
+        }
+
+        return NULL;
+}
+
+static inline bool
+lib2to3_grow_buffers(struct drawable *d)
+{
+        unsigned limit = d->swap_interval ? MAX_BUFFERS_VSYNC : MAX_BUFFERS;
+
+        if (d->buffer_count || (d->max_buffers >= limit))
+                return false;
+
+        ++d->max_buffers;
+        ++d->stats.grows;
+        LOG("growing drawable %x to %u buffers\n", d->drawable, d->max_buffers);
+        return true;
+}
+
+static inline void
+lib2to3_trim_buffers(struct drawable *d)
+{
+        unsigned live = lib2to3_live_buffers(d);
+
+        list_for_each_entry_safe(struct buffer, b, &d->buffers, link) {
+                if (b->busy || b->dead)
+                        continue;
+
+                if (live > d->max_buffers) {
+                        list_del(&b->link);
+                        lib2to3_free_buffer(d, b);
+                        --live;
+                        continue;
+                }
+
+                if (!d->buffer_count && (d->max_buffers > MIN_BUFFERS) &&
+                    (d->send_sbc - b->last_used > BUFFER_IDLE_FRAMES)) {
+                        list_del(&b->link);
+                        lib2to3_free_buffer(d, b);
+                        --live;
+                        --d->max_buffers;
+                        ++d->stats.shrinks;
+                        LOG("shrinking drawable %x to %u buffers\n",
+                            d->drawable, d->max_buffers);
+                }
+        }
+}
+
+/* After a timed out wait: allocate an extra buffer, which trimming undoes
+ * once buffers are idle again.  A busy buffer is never handed back, as
+ * its PresentPixmap may still be queued and read, so past
+ * MAX_BUFFERS_OVERALLOC this returns NULL. */
+static inline struct buffer *
+lib2to3_timeout_buffer(struct drawable *d)
+{
+        ++d->stats.timeouts;
+
+        if (d->num_buffers < d->max_buffers + MAX_BUFFERS_OVERALLOC) {
+                struct buffer *b = lib2to3_create_buffer(d);
+                if (b) {
+                        ++d->stats.overallocs;
+                        return lib2to3_set_buffer(d, b);
+                }
+        }
+
+        return NULL;
+}
+
+static inline struct buffer *
+lib2to3_get_buffer(struct drawable *d)
+{
+        lib2to3_flush_events(d);
+
+        if (d->cur) {
+                /* Either handed out before a resize or prefetched by the
+                 * last swap; only keep it if it still matches */
+                if ((d->cur->width == d->width) &&
+                    (d->cur->height == d->height))
+                        return lib2to3_set_buffer(d, d->cur);
+
+                lib2to3_free_buffer(d, d->cur);
+                d->cur = NULL;
+        }
+
+        uint64_t deadline = 0;
+        bool bounded = d->max_wait_ns;
+
+        for (;;) {
+                struct buffer *b = lib2to3_take_idle_buffer(d);
+                if (b)
+                        return lib2to3_set_buffer(d, b);
+
+                if ((d->num_buffers < d->max_buffers) ||
+                    lib2to3_grow_buffers(d)) {
+                        b = lib2to3_create_buffer(d);
+                        return lib2to3_set_buffer(d, b);
+                }
+
+                ++d->stats.waits;
+
+                uint64_t start = (d->shm_stats || bounded) ? trace_now() : 0;
+                bool ret;
+
+                if (bounded) {
+                        if (!deadline)
+                                deadline = start + d->max_wait_ns;
+
+                        ret = lib2to3_wait_for_event_until(d, deadline);
+
+                        if (!ret && !xcb_connection_has_error(d->conn)) {
+                                b = lib2to3_timeout_buffer(d);
+                                if (b)
+                                        return b;
+
+                                /* Already overallocated, so wait as long
+                                 * as it takes after all */
+                                bounded = false;
+                                ret = true;
+                        }
+                } else {
+                        ret = lib2to3_wait_for_buffer(d);
+                }
+
+                if (d->shm_stats) {
+                        stats_hist_add(&d->shm_stats->wait_time,
+                                       trace_now() - start);
+                        d->shm_stats->waits = d->stats.waits;
+                }
+
+                if (!ret)
+                        return NULL;
+        }
+}
+
+/* Called right after a swap: pick the next back buffer while the client
+ * is still busy elsewhere, but never block for it */
+static inline void
+lib2to3_prefetch_buffer(struct drawable *d)
+{
+        lib2to3_flush_events(d);
+        lib2to3_trim_buffers(d);
+
+        struct buffer *b = lib2to3_take_idle_buffer(d);
+
+        if (!b && (d->num_buffers < d->max_buffers))
+                b = lib2to3_create_buffer(d);
+
+        d->cur = b;
+}
+
+static inline void
+lib2to3_free_aux_buffer(struct drawable *d, struct buffer *b)
+{
+        ++d->num_buffers;
+        lib2to3_free_buffer(d, b);
+}
+
+/* For copies between the window and its buffers.  Users set the clip they
+ * need before each copy. */
+static inline xcb_gcontext_t
+lib2to3_get_gc(struct drawable *d)
+{
+        if (!d->gc) {
+                /* Otherwise every copy sends the client a NoExpose event */
+                uint32_t exposures = 0;
+
+                d->gc = xcb_generate_id(d->conn);
+                xcb_create_gc(d->conn, d->gc, d->drawable,
+                              XCB_GC_GRAPHICS_EXPOSURES, &exposures);
+        }
+
+        return d->gc;
+}
+
+/* Color buffers are copied to and from the window, so they always have its
+ * depth.  Other attachments use the depth GetBuffersWithFormat asked for. */
+static inline uint32_t
+lib2to3_attachment_depth(struct drawable *d, uint32_t attachment,
+                         uint32_t format)
+{
+        switch (attachment) {
+        case XCB_DRI2_ATTACHMENT_BUFFER_FRONT_LEFT:
+        case XCB_DRI2_ATTACHMENT_BUFFER_BACK_LEFT:
+        case XCB_DRI2_ATTACHMENT_BUFFER_FRONT_RIGHT:
+        case XCB_DRI2_ATTACHMENT_BUFFER_BACK_RIGHT:
+        case XCB_DRI2_ATTACHMENT_BUFFER_FAKE_FRONT_LEFT:
+        case XCB_DRI2_ATTACHMENT_BUFFER_FAKE_FRONT_RIGHT:
+                return d->depth;
+        default:
+                return format ? format : d->depth;
+        }
+}
+
+/* The real front buffer is the window itself, which DRI3 does not expose,
+ * so rendering to the front goes to the fake front instead */
+static inline struct buffer *
+lib2to3_get_aux_buffer(struct drawable *d, uint32_t attachment, uint32_t depth)
+{
+        if (attachment == XCB_DRI2_ATTACHMENT_BUFFER_FRONT_LEFT)
+                attachment = XCB_DRI2_ATTACHMENT_BUFFER_FAKE_FRONT_LEFT;
+
+        struct buffer *b = d->aux[attachment];
+
+        if (b && (b->width == d->width) && (b->height == d->height) &&
+            (b->depth == depth)) {
+                lib2to3_handle_reuse(b->gem);
+                return b;
+        }
+
+        if (b)
+                lib2to3_free_aux_buffer(d, b);
+
+        b = lib2to3_create_buffer_depth(d, depth);
+
+        /* Not part of the swapchain */
+        if (b)
+                --d->num_buffers;
+
+        /* Like the server's DRI2, start a new fake front with what the
+         * window shows, which glXWaitX and front buffer reads rely on */
+        if (b && ((attachment == XCB_DRI2_ATTACHMENT_BUFFER_FAKE_FRONT_LEFT) ||
+                  (attachment == XCB_DRI2_ATTACHMENT_BUFFER_FAKE_FRONT_RIGHT))) {
+                uint32_t clip = XCB_NONE;
+                xcb_gcontext_t gc = lib2to3_get_gc(d);
+
+                xcb_change_gc(d->conn, gc, XCB_GC_CLIP_MASK, &clip);
+                xcb_copy_area(d->conn, d->drawable, b->pixmap, gc,
+                              0, 0, 0, 0, d->width, d->height);
+        }
+
+        if (b)
+                lib2to3_handle_reuse(b->gem);
+
+        d->aux[attachment] = b;
+        return b;
+}
+
+static inline struct buffer *
+lib2to3_attachment_buffer(struct drawable *d, uint32_t attachment)
+{
+        if (attachment == XCB_DRI2_ATTACHMENT_BUFFER_BACK_LEFT)
+                return d->cur;
+
+        if (attachment == XCB_DRI2_ATTACHMENT_BUFFER_FRONT_LEFT)
+                attachment = XCB_DRI2_ATTACHMENT_BUFFER_FAKE_FRONT_LEFT;
+
+        return d->aux[attachment];
+}
+
+/* Unknown attachments and any past the first NUM_ATTACHMENTS are left out
+ * of the reply, as the server would for attachments it cannot allocate.
+ * With formats, attachments holds attachment/format pairs as on the wire. */
+static inline void
+lib2to3_get_buffers(struct drawable *d, uint32_t count,
+                    const uint32_t *attachments, bool formats)
+{
+        unsigned stride = formats ? 2 : 1;
+
+        d->num_attachments = 0;
+
+        for (uint32_t i = 0; i < count; ++i) {
+                uint32_t attachment = attachments[i * stride];
+                uint32_t format = formats ? attachments[i * stride + 1] : 0;
+
+                if ((attachment >= NUM_ATTACHMENTS) ||
+                    (d->num_attachments == NUM_ATTACHMENTS))
+                        continue;
+
+                if (attachment == XCB_DRI2_ATTACHMENT_BUFFER_BACK_LEFT)
+                        lib2to3_get_buffer(d);
+                else
+                        lib2to3_get_aux_buffer(d, attachment,
+                                               lib2to3_attachment_depth(d, attachment, format));
+
+                d->attachments[d->num_attachments++] = attachment;
+        }
+}
+
+/* As a CopyRegion source or destination, the front buffer is the window */
+static inline xcb_drawable_t
+lib2to3_attachment_drawable(struct drawable *d, uint32_t attachment)
+{
+        struct buffer *b;
+
+        switch (attachment) {
+        case XCB_DRI2_ATTACHMENT_BUFFER_FRONT_LEFT:
+                return d->drawable;
+        case XCB_DRI2_ATTACHMENT_BUFFER_BACK_LEFT:
+                b = d->cur;
+                break;
+        default:
+                b = attachment < NUM_ATTACHMENTS ? d->aux[attachment] : NULL;
+                break;
+        }
+
+        return b ? b->pixmap : 0;
+}
+
+static inline void
+lib2to3_copy_region(struct drawable *d, xcb_xfixes_region_t region,
+                    uint32_t dest, uint32_t src)
+{
+        xcb_drawable_t src_drawable = lib2to3_attachment_drawable(d, src);
+        xcb_drawable_t dst_drawable = lib2to3_attachment_drawable(d, dest);
+
+        if (!src_drawable || !dst_drawable || (src_drawable == dst_drawable))
+                return;
+
+        lib2to3_get_gc(d);
+
+        if (d->c->has_regions)
+                xcb_xfixes_set_gc_clip_region(d->conn, d->gc, region, 0, 0);
+
+        xcb_copy_area(d->conn, src_drawable, dst_drawable, d->gc,
+                      0, 0, 0, 0, d->width, d->height);
+}
+
+static inline bool
+lib2to3_damage_begin(struct drawable *d)
+{
+        if (!d->c->has_regions)
+                return false;
+
+        if (!d->damage) {
+                d->damage = xcb_generate_id(d->conn);
+                xcb_xfixes_create_region(d->conn, d->damage, 0, NULL);
+        }
+
+        return true;
+}
+
+static inline void
+lib2to3_add_damage(struct drawable *d, uint32_t n,
+                   const xcb_rectangle_t *rects)
+{
+        if (!lib2to3_damage_begin(d))
+                return;
+
+        if (!d->has_damage) {
+                xcb_xfixes_set_region(d->conn, d->damage, n, rects);
+        } else {
+                xcb_xfixes_region_t region = xcb_generate_id(d->conn);
+                xcb_xfixes_create_region(d->conn, region, n, rects);
+                xcb_xfixes_union_region(d->conn, d->damage, region, d->damage);
+                xcb_xfixes_destroy_region(d->conn, region);
+        }
+
+        d->has_damage = true;
+}
+
+/* An explicit DRI2 target/divisor/remainder is passed through as is.
+ * Otherwise interval 0 presents immediately and N one interval after the
+ * previous swap, so that queued swaps never share a target MSC and
+ * replace each other.  Until the first completion has told us the MSC,
+ * 1 presents at the next vblank and N on the next multiple of N. */
+static inline void
+lib2to3_swap_buffers(struct drawable *d, uint64_t target_msc,
+                     uint64_t divisor, uint64_t remainder)
+{
+        uint32_t options = XCB_PRESENT_OPTION_NONE;
+
+        ++d->send_sbc;
+
+        if (!target_msc && !divisor && !remainder) {
+                if (d->swap_interval == 0)
+                        options |= XCB_PRESENT_OPTION_ASYNC;
+                else if (d->msc)
+                        target_msc = d->msc + d->swap_interval *
+                                (d->send_sbc - d->recv_sbc);
+                else if (d->swap_interval > 1)
+                        divisor = d->swap_interval;
+        }
+
+        uint32_t idle_fence = 0;
+
+#ifdef HAVE_XSHMFENCE
+        if (d->cur->shm_fence) {
+                xshmfence_reset(d->cur->shm_fence);
+                idle_fence = d->cur->sync_fence;
+        }
+#endif
+
+        xcb_present_pixmap(d->conn, d->drawable, d->cur->pixmap,
+                           (uint32_t) d->send_sbc,
+                           0, d->has_damage ? d->damage : 0,
+                           0, 0, 0, 0, idle_fence, options,
+                           target_msc, divisor, remainder, 0, NULL);
+
+        /* The server reads the region when handling the request, so it
+         * can be reused for the next frame straight away */
+        d->has_damage = false;
+
+        TRACE(TRACE_PRESENT, d->drawable, d->send_sbc);
+
+        lib2to3_drawable_swap(d);
+        lib2to3_prefetch_buffer(d);
+}
+
+static inline void
+lib2to3_notify_msc(struct drawable *d, uint64_t target_msc,
+                   uint64_t divisor, uint64_t remainder)
+{
+        xcb_present_notify_msc(d->conn, d->drawable, ++d->notify_serial,
+                               target_msc, divisor, remainder);
+}
+
+static inline bool
+lib2to3_wait_notify_msc(struct drawable *d)
+{
+        lib2to3_flush_events(d);
+
+        while (d->notify_recv_serial != d->notify_serial) {
+                if (!lib2to3_wait_for_event(d))
+                        return false;
+        }
+
+        return true;
+}
+
+static inline bool
+lib2to3_wait_sbc(struct drawable *d, uint64_t target_sbc)
+{
+        if (!target_sbc || (target_sbc > d->send_sbc))
+                target_sbc = d->send_sbc;
+
+        lib2to3_flush_events(d);
+
+        while (d->recv_sbc < target_sbc) {
+                if (!lib2to3_wait_for_event(d))
+                        return false;
+        }
+
+        return true;
+}
+
+static inline void
+lib2to3_free_drawable(xcb_connection_t *conn, xcb_drawable_t drawable)
+{
+        _Atomic(struct drawable *) *link =
+                &drawable_hash[lib2to3_drawable_hash(conn, drawable)];
+        struct drawable *d;
+
+        LOCK();
+        while ((d = atomic_load_explicit(link, memory_order_relaxed))) {
+                if ((d->conn == conn) && (d->drawable == drawable))
+                        break;
+                link = &d->next;
+        }
+
+        if (!d) {
+                UNLOCK();
+                return;
+        }
+
+        lib2to3_seq_write_begin_locked();
+        atomic_store_explicit(link,
+                              atomic_load_explicit(&d->next, memory_order_relaxed),
+                              memory_order_relaxed);
+        lib2to3_seq_write_end_locked();
+        UNLOCK();
+
+        /* Once out of the list, the event thread no longer reads its
+         * queue, so nothing can be added to d->pending */
+        pthread_mutex_lock(&d->c->lock);
+        list_del(&d->conn_link);
+        pthread_mutex_unlock(&d->c->lock);
+
+        pthread_mutex_lock(&d->lock);
+        lib2to3_handle_pending_events(d);
+        /* Stop the server sending events for a queue about to go away */
+        xcb_present_select_input(d->conn, d->eid, d->drawable,
+                                 XCB_PRESENT_EVENT_MASK_NO_EVENT);
+        xcb_unregister_for_special_event(d->conn, d->special_event);
+
+        list_for_each_entry_safe(struct buffer, b, &d->buffers, link) {
+                list_del(&b->link);
+                lib2to3_free_buffer(d, b);
+        }
+
+        if (d->cur)
+                lib2to3_free_buffer(d, d->cur);
+        for (unsigned i = 0; i < NUM_ATTACHMENTS; ++i) {
+                if (d->aux[i])
+                        lib2to3_free_aux_buffer(d, d->aux[i]);
+        }
+        if (d->gc)
+                xcb_free_gc(d->conn, d->gc);
+        if (d->damage)
+                xcb_xfixes_destroy_region(d->conn, d->damage);
+        while (d->modifiers) {
+                struct modifier_list *m = d->modifiers;
+                d->modifiers = m->next;
+                free(m);
+        }
+        lib2to3_stats_release(d->shm_stats);
+        d->destroyed = true;
+        pthread_mutex_unlock(&d->lock);
+
+        lib2to3_drawable_unref(d);
 }
 #endif
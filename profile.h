@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef PROFILE_INCLUDE_GUARD
+#define PROFILE_INCLUDE_GUARD
+
+/* Per-ioctl profiling, enabled with DRI2TO3_PROFILE=<file> ("-" for
+ * stderr).  Every thread counts into its own table, indexed by ioctl
+ * type/nr, so the hook takes no locks.  The tables are merged and written
+ * out at exit or when the process receives SIGUSR2, and exported to the
+ * DRI2TO3_STATS segment for dri2to3-top. */
+
+#define PROFILE_SLOTS STATS_MAX_IOCTLS
+
+struct profile_shard {
+        struct profile_shard *next;
+        struct stats_ioctl ioctls[PROFILE_SLOTS];
+};
+
+static bool profile_enabled;
+static const char *profile_path;
+static atomic_bool profile_dump_requested;
+static _Atomic(struct profile_shard *) profile_shards;
+static __thread struct profile_shard *profile_shard;
+
+/* Find the slot for key, taking a free one if it has none yet.  Returns
+ * NULL once the table is full. */
+static inline struct stats_ioctl *
+profile_slot(struct stats_ioctl *table, uint32_t key)
+{
+        unsigned i = (key * 2654435761u) % PROFILE_SLOTS;
+
+        for (unsigned n = 0; n < PROFILE_SLOTS; ++n) {
+                struct stats_ioctl *e = &table[(i + n) % PROFILE_SLOTS];
+                uint32_t k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+
+                if (k == key)
+                        return e;
+
+                if (!k) {
+                        __atomic_store_n(&e->key, key, __ATOMIC_RELEASE);
+                        return e;
+                }
+        }
+
+        return NULL;
+}
+
+static inline struct profile_shard *
+profile_shard_create(void)
+{
+        struct profile_shard *s = calloc(1, sizeof(*s));
+
+        struct profile_shard *head = atomic_load(&profile_shards);
+        do {
+                s->next = head;
+        } while (!atomic_compare_exchange_weak(&profile_shards, &head, s));
+
+        return s;
+}
+
+/* out must be zeroed, or hold totals of an earlier merge to overwrite */
+static inline void
+profile_merge(struct stats_ioctl *out)
+{
+        struct stats_ioctl merged[PROFILE_SLOTS] = { 0 };
+
+        for (struct profile_shard *s = atomic_load(&profile_shards); s; s = s->next) {
+                for (unsigned i = 0; i < PROFILE_SLOTS; ++i) {
+                        struct stats_ioctl e = s->ioctls[i];
+                        if (!e.key)
+                                continue;
+
+                        struct stats_ioctl *m = profile_slot(merged, e.key);
+                        if (!m)
+                                continue;
+
+                        m->count += e.count;
+                        m->total_ns += e.total_ns;
+                        if (!m->min_ns || (e.min_ns < m->min_ns))
+                                m->min_ns = e.min_ns;
+                        if (e.max_ns > m->max_ns)
+                                m->max_ns = e.max_ns;
+                        for (unsigned b = 0; b < STATS_HIST_BUCKETS; ++b)
+                                m->latency.count[b] += e.latency.count[b];
+                }
+        }
+
+        /* Keys keep their slot in out, so readers can diff successive
+         * merges */
+        for (unsigned i = 0; i < PROFILE_SLOTS; ++i) {
+                if (!merged[i].key)
+                        continue;
+
+                struct stats_ioctl *o = profile_slot(out, merged[i].key);
+                if (o)
+                        *o = merged[i];
+        }
+}
+
+/* Upper bound of the bucket holding the given percentile, in us */
+static inline uint64_t
+profile_percentile(const struct stats_hist *h, uint64_t count, unsigned pct)
+{
+        uint64_t target = count * pct / 100;
+        uint64_t sum = 0;
+
+        for (unsigned i = 0; i < STATS_HIST_BUCKETS; ++i) {
+                sum += h->count[i];
+                if (sum > target)
+                        return 2ull << i;
+        }
+
+        return 2ull << (STATS_HIST_BUCKETS - 1);
+}
+
+static int
+profile_compare(const void *a, const void *b)
+{
+        const struct stats_ioctl *x = a, *y = b;
+
+        return (x->total_ns < y->total_ns) - (x->total_ns > y->total_ns);
+}
+
+static inline void
+profile_dump(void)
+{
+        struct stats_ioctl merged[PROFILE_SLOTS] = { 0 };
+        profile_merge(merged);
+        qsort(merged, PROFILE_SLOTS, sizeof(*merged), profile_compare);
+
+        bool to_stderr = !strcmp(profile_path, "-");
+        FILE *f = to_stderr ? stderr : fopen(profile_path, "w");
+        if (!f)
+                return;
+
+        fprintf(f, "%-6s %4s %10s %12s %10s %10s %10s %10s %10s\n",
+                "type", "nr", "calls", "total ms", "avg us", "min us",
+                "max us", "p50 us", "p99 us");
+
+        for (unsigned i = 0; i < PROFILE_SLOTS; ++i) {
+                struct stats_ioctl *e = &merged[i];
+                if (!e->key || !e->count)
+                        continue;
+
+                unsigned type = STATS_IOCTL_TYPE(e->key);
+                char name[8];
+                if ((type >= 0x20) && (type < 0x7f))
+                        snprintf(name, sizeof(name), "'%c'", type);
+                else
+                        snprintf(name, sizeof(name), "0x%02x", type);
+
+                fprintf(f, "%-6s 0x%02x %10" PRIu64 " %12.3f %10.2f %10.2f %10.2f"
+                        " %10" PRIu64 " %10" PRIu64 "\n",
+                        name, STATS_IOCTL_NR(e->key), e->count,
+                        e->total_ns / 1e6, e->total_ns / 1e3 / e->count,
+                        e->min_ns / 1e3, e->max_ns / 1e3,
+                        profile_percentile(&e->latency, e->count, 50),
+                        profile_percentile(&e->latency, e->count, 99));
+        }
+
+        if (to_stderr)
+                fflush(f);
+        else
+                fclose(f);
+}
+
+static inline void
+profile_record(unsigned long request, uint64_t ns)
+{
+        struct profile_shard *s = profile_shard;
+        if (!s)
+                s = profile_shard = profile_shard_create();
+
+        struct stats_ioctl *e =
+                profile_slot(s->ioctls, STATS_IOCTL_KEY(_IOC_TYPE(request),
+                                                        _IOC_NR(request)));
+        if (e) {
+                ++e->count;
+                e->total_ns += ns;
+                if (!e->min_ns || (ns < e->min_ns))
+                        e->min_ns = ns;
+                if (ns > e->max_ns)
+                        e->max_ns = ns;
+                stats_hist_add(&e->latency, ns);
+        }
+
+        if (atomic_load_explicit(&profile_dump_requested, memory_order_relaxed) &&
+            atomic_exchange(&profile_dump_requested, false))
+                profile_dump();
+}
+
+static void
+profile_signal(int sig)
+{
+        atomic_store(&profile_dump_requested, true);
+}
+
+static void __attribute__((destructor))
+profile_fini(void)
+{
+        if (profile_enabled)
+                profile_dump();
+}
+
+static inline void
+profile_init(void)
+{
+        profile_path = getenv("DRI2TO3_PROFILE");
+        if (!profile_path || !*profile_path)
+                return;
+
+        signal(SIGUSR2, profile_signal);
+        profile_enabled = true;
+}
+
+#endif
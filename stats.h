@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef STATS_INCLUDE_GUARD
+#define STATS_INCLUDE_GUARD
+
+/* Layout of the per-process statistics segment published in
+ * /dev/shm/dri2to3-<pid> when DRI2TO3_STATS is set, and read by
+ * dri2to3-top.  Each drawable slot only has one writer, the thread
+ * holding the drawable's lock; readers copy it and live with tearing. */
+
+#include <stdint.h>
+
+#define STATS_MAGIC 0x33746f32
+#define STATS_VERSION 2
+#define STATS_NAME_FORMAT "/dri2to3-%d"
+
+#define STATS_MAX_DRAWABLES 64
+#define STATS_MAX_IOCTLS 64
+
+/* Bucket i counts samples in [2^i, 2^(i+1)) microseconds */
+#define STATS_HIST_BUCKETS 32
+
+struct stats_hist {
+        uint64_t count[STATS_HIST_BUCKETS];
+};
+
+struct stats_drawable {
+        uint32_t in_use;
+        uint32_t generation;
+
+        uint32_t drawable;
+        uint32_t width, height;
+        uint32_t buffers;
+        uint32_t max_buffers;
+        uint64_t bytes;
+
+        uint64_t frames;
+        uint64_t waits;
+
+        struct stats_hist frame_time;
+        struct stats_hist present_latency;
+        struct stats_hist wait_time;
+};
+
+/* Totals for one ioctl type/nr.  Used for each thread's profile as well,
+ * where only the owning thread writes. */
+struct stats_ioctl {
+        uint32_t key;
+        uint32_t pad;
+
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t min_ns, max_ns;
+        struct stats_hist latency;
+};
+
+/* key is 0 for an unused slot */
+#define STATS_IOCTL_KEY(type, nr) ((1u << 16) | ((type) << 8) | (nr))
+#define STATS_IOCTL_TYPE(key) (((key) >> 8) & 0xff)
+#define STATS_IOCTL_NR(key) ((key) & 0xff)
+
+struct stats_shm {
+        uint32_t magic;
+        uint32_t version;
+        int32_t pid;
+        char comm[16];
+
+        struct stats_drawable drawables[STATS_MAX_DRAWABLES];
+
+        /* Filled about once a second when DRI2TO3_PROFILE is set too */
+        struct stats_ioctl ioctls[STATS_MAX_IOCTLS];
+};
+
+static inline void
+stats_hist_add(struct stats_hist *h, uint64_t ns)
+{
+        uint64_t us = ns / 1000;
+        unsigned bucket = us ? 63 - __builtin_clzll(us) : 0;
+
+        if (bucket >= STATS_HIST_BUCKETS)
+                bucket = STATS_HIST_BUCKETS - 1;
+
+        ++h->count[bucket];
+}
+
+#endif
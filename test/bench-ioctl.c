@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Times the ioctl interposer against calling the mock syscall directly,
+ * for an ioctl that is not DRM, like the blob's job submission, and for a
+ * DRM one the interposer passes through.  Run with DRI2TO3_PROFILE set to
+ * include the cost of profiling. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+
+/* Shaped like a Mali kbase ioctl */
+#define JOB_SUBMIT _IOW(0x80, 2, uint64_t)
+
+static unsigned calls = 10000000;
+
+static uint64_t
+now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double
+time_raw(int fd, unsigned long request, void *arg)
+{
+        uint64_t start = now_ns();
+
+        for (unsigned i = 0; i < calls; ++i)
+                mock_ioctl(fd, request, arg);
+
+        return (double) (now_ns() - start) / calls;
+}
+
+static double
+time_interposed(int fd, unsigned long request, void *arg)
+{
+        uint64_t start = now_ns();
+
+        for (unsigned i = 0; i < calls; ++i)
+                ioctl(fd, request, arg);
+
+        return (double) (now_ns() - start) / calls;
+}
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr, "usage: %s [-n calls]\n", argv0);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        calls = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (!calls)
+                usage(argv[0]);
+
+        mock_init(NULL);
+        int fd = mock_drm_open();
+
+        uint64_t job = 0;
+        struct drm_get_cap cap = { 0 };
+
+        /* Warm up, so the first call resolving anything is not timed */
+        ioctl(fd, JOB_SUBMIT, &job);
+        ioctl(fd, DRM_IOCTL_GET_CAP, &cap);
+
+        double raw = time_raw(fd, JOB_SUBMIT, &job);
+        double interposed = time_interposed(fd, JOB_SUBMIT, &job);
+        double drm_raw = time_raw(fd, DRM_IOCTL_GET_CAP, &cap);
+        double drm_interposed = time_interposed(fd, DRM_IOCTL_GET_CAP, &cap);
+
+        printf("%s, ns per call:\n",
+               getenv("DRI2TO3_PROFILE") ? "profiled" : "not profiled");
+        printf("other: %5.1f raw, %5.1f interposed, %+5.1f\n",
+               raw, interposed, interposed - raw);
+        printf("DRM:   %5.1f raw, %5.1f interposed, %+5.1f\n",
+               drm_raw, drm_interposed, drm_interposed - drm_raw);
+
+        close(fd);
+        mock_fini();
+
+        return 0;
+}
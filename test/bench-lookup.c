@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Times drawable lookups as the window count grows: the same window each
+ * time, which the per-thread cache answers, and every window in turn,
+ * which goes to the hash table.  Lookups go through
+ * dri2to3_get_drawable_stats, which adds taking the drawable's lock. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dri2to3.h"
+#include "client.h"
+
+static xcb_connection_t *conn;
+
+static xcb_window_t *windows;
+static unsigned num_windows;
+static unsigned num_threads = 1;
+static unsigned lookups = 1000000;
+static bool round_robin;
+
+static uint64_t
+now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool
+lookup(xcb_window_t window)
+{
+        struct dri2to3_drawable_stats stats;
+
+        return !dri2to3_get_drawable_stats(conn, window, &stats);
+}
+
+/* Each thread starts at a different window so they do not share one */
+static void *
+run_thread(void *data)
+{
+        unsigned t = (uintptr_t) data;
+
+        for (unsigned i = 0; i < lookups; ++i) {
+                unsigned w = round_robin ? i + t : t;
+
+                if (!lookup(windows[w % num_windows])) {
+                        fprintf(stderr, "lookup of window %u failed\n",
+                                w % num_windows);
+                        exit(1);
+                }
+        }
+
+        return NULL;
+}
+
+static double
+run(bool rr)
+{
+        pthread_t threads[num_threads];
+        round_robin = rr;
+
+        uint64_t start = now_ns();
+
+        for (unsigned t = 0; t < num_threads; ++t)
+                pthread_create(&threads[t], NULL, run_thread,
+                               (void *) (uintptr_t) t);
+        for (unsigned t = 0; t < num_threads; ++t)
+                pthread_join(threads[t], NULL);
+
+        return (double) (now_ns() - start) / lookups;
+}
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr, "usage: %s [-w max windows] [-t threads] [-n lookups]\n",
+                argv0);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        unsigned max_windows = 1024;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "w:t:n:")) != -1) {
+                switch (opt) {
+                case 'w':
+                        max_windows = strtoul(optarg, NULL, 0);
+                        break;
+                case 't':
+                        num_threads = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        lookups = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (!max_windows || !num_threads || !lookups)
+                usage(argv[0]);
+
+        mock_init(NULL);
+        conn = mock_connect();
+
+        windows = calloc(max_windows, sizeof(*windows));
+        windows[0] = mock_create_window(conn, 64, 64);
+        client_connect(conn, windows[0]);
+
+        printf("%u threads, ns per lookup on each:\n", num_threads);
+
+        for (unsigned count = 1; count <= max_windows; count *= 4) {
+                for (; num_windows < count; ++num_windows) {
+                        if (num_windows)
+                                windows[num_windows] =
+                                        mock_create_window(conn, 64, 64);
+                        xcb_dri2_create_drawable_checked(conn,
+                                                         windows[num_windows]);
+                }
+
+                double same = run(false);
+                double rr = run(true);
+
+                printf("%5u windows: %6.1f same window, %6.1f round robin\n",
+                       count, same, rr);
+        }
+
+        for (unsigned i = 0; i < num_windows; ++i)
+                xcb_dri2_destroy_drawable_checked(conn, windows[i]);
+
+        xcb_disconnect(conn);
+        mock_fini();
+        free(windows);
+
+        return 0;
+}
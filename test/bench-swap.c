@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Times the get_buffers -> swap -> IdleNotify cycle against the mock
+ * server, across window counts, threads and resizes */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dri2to3.h"
+#include "client.h"
+
+static xcb_connection_t *conn;
+static int drm_fd;
+
+static xcb_window_t *windows;
+static unsigned num_windows = 1;
+static unsigned num_threads = 1;
+static unsigned frames = 1000;
+static unsigned resize_interval;
+static bool check;
+
+static uint64_t
+now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Each thread drives every num_threads'th window, a frame on each in turn */
+static void *
+run_thread(void *data)
+{
+        unsigned t = (uintptr_t) data;
+
+        for (unsigned f = 0; f < frames; ++f) {
+                for (unsigned i = t; i < num_windows; i += num_threads) {
+                        if (resize_interval && f && !(f % resize_interval)) {
+                                unsigned grow = (f / resize_interval) & 1;
+                                mock_resize_window(windows[i], 64 + grow * 16,
+                                                   64 + grow * 16);
+                        }
+
+                        if (!client_frame(conn, windows[i], drm_fd)) {
+                                fprintf(stderr, "frame %u of window %u failed\n",
+                                        f, i);
+                                exit(1);
+                        }
+                }
+        }
+
+        return NULL;
+}
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr, "usage: %s [-w windows] [-t threads] [-n frames] "
+                "[-r resize interval] [-R refresh us] [-I idle us] "
+                "[-a alloc us] [-l reply us] [-f] [-c]\n", argv0);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct mock_config config = {
+                .dri3_minor = 2,
+        };
+        int opt;
+
+        while ((opt = getopt(argc, argv, "w:t:n:r:R:I:a:l:fc")) != -1) {
+                switch (opt) {
+                case 'w':
+                        num_windows = strtoul(optarg, NULL, 0);
+                        break;
+                case 't':
+                        num_threads = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        frames = strtoul(optarg, NULL, 0);
+                        break;
+                case 'r':
+                        resize_interval = strtoul(optarg, NULL, 0);
+                        break;
+                case 'R':
+                        config.refresh_us = strtoul(optarg, NULL, 0);
+                        break;
+                case 'I':
+                        config.idle_us = strtoul(optarg, NULL, 0);
+                        break;
+                case 'a':
+                        config.alloc_us = strtoul(optarg, NULL, 0);
+                        break;
+                case 'l':
+                        config.reply_us = strtoul(optarg, NULL, 0);
+                        break;
+                case 'f':
+                        config.flip = true;
+                        break;
+                case 'c':
+                        check = true;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (!num_windows || !num_threads || (num_threads > num_windows))
+                usage(argv[0]);
+
+        mock_init(&config);
+        conn = mock_connect();
+
+        windows = calloc(num_windows, sizeof(*windows));
+        for (unsigned i = 0; i < num_windows; ++i)
+                windows[i] = mock_create_window(conn, 64, 64);
+
+        drm_fd = client_connect(conn, windows[0]);
+
+        for (unsigned i = 0; i < num_windows; ++i)
+                xcb_dri2_create_drawable_checked(conn, windows[i]);
+
+        pthread_t *threads = calloc(num_threads, sizeof(*threads));
+        uint64_t start = now_ns();
+
+        for (unsigned t = 0; t < num_threads; ++t)
+                pthread_create(&threads[t], NULL, run_thread,
+                               (void *) (uintptr_t) t);
+        for (unsigned t = 0; t < num_threads; ++t)
+                pthread_join(threads[t], NULL);
+
+        uint64_t elapsed = now_ns() - start;
+        free(threads);
+
+        printf("%u windows, %u threads, %u frames: %.0f ns/frame\n",
+               num_windows, num_threads, frames,
+               (double) elapsed / ((uint64_t) num_windows * frames));
+
+        for (unsigned i = 0; i < num_windows; ++i) {
+                struct dri2to3_drawable_stats stats;
+                dri2to3_get_drawable_stats(conn, windows[i], &stats);
+
+                if (check && (stats.frames != frames)) {
+                        fprintf(stderr, "window %u swapped %llu of %u frames\n",
+                                i, (unsigned long long) stats.frames, frames);
+                        return 1;
+                }
+
+                xcb_dri2_destroy_drawable_checked(conn, windows[i]);
+        }
+
+        xcb_disconnect(conn);
+
+        struct mock_stats stats;
+        mock_get_stats(&stats);
+        mock_fini();
+
+        printf("%llu presents, %llu completes, %llu skips, %llu idles, "
+               "%llu allocations, %llu round trips\n",
+               (unsigned long long) stats.presents,
+               (unsigned long long) stats.completes,
+               (unsigned long long) stats.skips,
+               (unsigned long long) stats.idles,
+               (unsigned long long) stats.allocs,
+               (unsigned long long) stats.round_trips);
+
+        /* Everything goes back to the server with the connection */
+        if (check && (stats.live_bos || stats.live_pixmaps)) {
+                fprintf(stderr, "%lli BOs and %lli pixmaps leaked\n",
+                        (long long) stats.live_bos,
+                        (long long) stats.live_pixmaps);
+                return 1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CLIENT_INCLUDE_GUARD
+#define CLIENT_INCLUDE_GUARD
+
+/* What a DRI2 driver does with the library, for the tests and benchmarks:
+ * link against libdri2to3 and then libdri2to3-mock, so that both the
+ * driver's DRI2 calls and the library's X and DRM calls stay in process */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+
+#include <drm.h>
+#include <xcb/xcb.h>
+#include <xcb/dri2.h>
+
+#include "mock.h"
+
+/* Connects as a DRI2 driver would, authenticating on a mock device so the
+ * library allocates from it.  Returns the device fd. */
+static inline int
+client_connect(xcb_connection_t *conn, xcb_window_t window)
+{
+        free(xcb_dri2_connect_reply(conn, xcb_dri2_connect(conn, window, 0),
+                                    NULL));
+
+        int drm_fd = mock_drm_open();
+        struct drm_auth auth = { 0 };
+        ioctl(drm_fd, DRM_IOCTL_GET_MAGIC, &auth);
+
+        free(xcb_dri2_authenticate_reply(conn,
+                                         xcb_dri2_authenticate(conn, window,
+                                                               auth.magic),
+                                         NULL));
+
+        return drm_fd;
+}
+
+/* Gets the back buffer, imports it by name and swaps, closing the handle
+ * again as the driver does when the next back buffer replaces it */
+static inline bool
+client_frame(xcb_connection_t *conn, xcb_drawable_t drawable, int drm_fd)
+{
+        uint32_t attachment = XCB_DRI2_ATTACHMENT_BUFFER_BACK_LEFT;
+
+        xcb_dri2_get_buffers_reply_t *reply =
+                xcb_dri2_get_buffers_reply(conn,
+                                           xcb_dri2_get_buffers(conn, drawable,
+                                                                1, 1,
+                                                                &attachment),
+                                           NULL);
+        if (!reply)
+                return false;
+
+        /* The buffers follow the reply */
+        xcb_dri2_dri2_buffer_t *buffers = (void *) (reply + 1);
+        struct drm_gem_open open = { .name = buffers[0].name };
+        free(reply);
+
+        if (ioctl(drm_fd, DRM_IOCTL_GEM_OPEN, &open))
+                return false;
+
+        free(xcb_dri2_swap_buffers_reply(conn,
+                                         xcb_dri2_swap_buffers(conn, drawable,
+                                                               0, 0, 0, 0,
+                                                               0, 0),
+                                         NULL));
+
+        struct drm_gem_close close = { .handle = open.handle };
+        ioctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &close);
+
+        return true;
+}
+
+#endif
@@ -0,0 +1,1263 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <drm.h>
+#include <drm_mode.h>
+#include <drm_fourcc.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/present.h>
+#include <xcb/dri3.h>
+#include <xcb/xfixes.h>
+
+#ifdef HAVE_XSHMFENCE
+#include <xcb/sync.h>
+#include <X11/xshmfence.h>
+#endif
+
+#include "mock.h"
+
+#define MOCK_MAX_FDS 4096
+#define MOCK_MAX_SELECTIONS 16
+
+xcb_extension_t xcb_present_id = { "Present", 0 };
+xcb_extension_t xcb_dri3_id = { "DRI3", 0 };
+xcb_extension_t xcb_xfixes_id = { "XFIXES", 0 };
+
+struct mock_event {
+        struct mock_event *next;
+        xcb_generic_event_t *ev;
+};
+
+struct xcb_special_event {
+        struct xcb_special_event *next;
+        xcb_connection_t *conn;
+        uint32_t eid;
+        struct mock_event *head, **tail;
+};
+
+struct xcb_connection_t {
+        /* Readable while events sit unread "on the socket" */
+        int event_fd;
+};
+
+struct mock_window {
+        struct mock_window *next;
+        xcb_window_t window;
+        uint16_t width, height;
+
+        struct {
+                xcb_connection_t *conn;
+                uint32_t eid;
+                uint32_t mask;
+        } selections[MOCK_MAX_SELECTIONS];
+        unsigned num_selections;
+
+        /* In flip mode, the buffer on screen */
+        bool has_shown;
+        xcb_pixmap_t shown_pixmap;
+        uint32_t shown_serial;
+        uint32_t shown_fence;
+};
+
+/* A queued present, or a NotifyMSC when pixmap is 0 */
+struct mock_present {
+        struct mock_present *next;
+        struct mock_window *w;
+        xcb_pixmap_t pixmap;
+        uint32_t serial;
+        uint32_t idle_fence;
+        uint64_t target_msc;
+        bool immediate;
+};
+
+struct mock_idle {
+        struct mock_idle *next;
+        uint64_t due_ns;
+        struct mock_window *w;
+        xcb_pixmap_t pixmap;
+        uint32_t serial;
+        uint32_t fence;
+};
+
+/* Everything on the "server" is under mock_lock */
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mock_server_cond;
+static pthread_cond_t mock_event_cond = PTHREAD_COND_INITIALIZER;
+
+static struct mock_config config;
+static struct mock_stats stats;
+
+static pthread_t server_thread;
+static bool server_stop;
+
+static uint64_t msc;
+static uint64_t next_vblank_ns;
+
+static struct mock_window *windows;
+static struct xcb_special_event *queues;
+static struct mock_present *presents;
+static struct mock_idle *idles;
+
+static atomic_uint next_xid = 0x200000;
+static atomic_uint next_handle = 1;
+
+static bool drm_fds[MOCK_MAX_FDS];
+
+static uint64_t
+mock_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+mock_sleep_us(unsigned us)
+{
+        if (!us)
+                return;
+
+        struct timespec ts = {
+                .tv_sec = us / 1000000,
+                .tv_nsec = (us % 1000000) * 1000,
+        };
+        nanosleep(&ts, NULL);
+}
+
+static void
+mock_request(void)
+{
+        pthread_mutex_lock(&mock_lock);
+        ++stats.requests;
+        pthread_mutex_unlock(&mock_lock);
+}
+
+static void
+mock_round_trip(void)
+{
+        mock_sleep_us(config.reply_us);
+
+        pthread_mutex_lock(&mock_lock);
+        ++stats.round_trips;
+        pthread_mutex_unlock(&mock_lock);
+}
+
+static struct mock_window *
+mock_find_window_locked(xcb_window_t window)
+{
+        for (struct mock_window *w = windows; w; w = w->next) {
+                if (w->window == window)
+                        return w;
+        }
+
+        return NULL;
+}
+
+static struct xcb_special_event *
+mock_find_queue_locked(xcb_connection_t *conn, uint32_t eid)
+{
+        for (struct xcb_special_event *se = queues; se; se = se->next) {
+                if ((se->conn == conn) && (se->eid == eid))
+                        return se;
+        }
+
+        return NULL;
+}
+
+/* Queue a copy of ev for every event context selecting mask on w */
+static void
+mock_send_locked(struct mock_window *w, uint32_t mask, const void *ev,
+                 size_t size)
+{
+        for (unsigned i = 0; i < w->num_selections; ++i) {
+                if (!(w->selections[i].mask & mask))
+                        continue;
+
+                struct xcb_special_event *se =
+                        mock_find_queue_locked(w->selections[i].conn,
+                                               w->selections[i].eid);
+                if (!se)
+                        continue;
+
+                xcb_present_generic_event_t *copy = malloc(size);
+                memcpy(copy, ev, size);
+                copy->event = se->eid;
+
+                struct mock_event *e = malloc(sizeof(*e));
+                *e = (struct mock_event) { .ev = (void *) copy };
+                *se->tail = e;
+                se->tail = &e->next;
+
+                eventfd_write(se->conn->event_fd, 1);
+        }
+
+        pthread_cond_broadcast(&mock_event_cond);
+}
+
+static void
+mock_complete_locked(struct mock_window *w, xcb_pixmap_t pixmap,
+                     uint32_t serial, uint8_t mode)
+{
+        xcb_present_complete_notify_event_t ev = {
+                .response_type = XCB_GE_GENERIC,
+                .event_type = XCB_PRESENT_EVENT_COMPLETE_NOTIFY,
+                .kind = pixmap ? XCB_PRESENT_COMPLETE_KIND_PIXMAP :
+                        XCB_PRESENT_COMPLETE_KIND_NOTIFY_MSC,
+                .mode = mode,
+                .window = w->window,
+                .serial = serial,
+                .ust = mock_now() / 1000,
+                .msc = msc,
+        };
+
+        if (pixmap) {
+                if (mode == XCB_PRESENT_COMPLETE_MODE_SKIP)
+                        ++stats.skips;
+                else
+                        ++stats.completes;
+        }
+
+        mock_send_locked(w, XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY,
+                         &ev, sizeof(ev));
+}
+
+#ifdef HAVE_XSHMFENCE
+static void
+mock_trigger_fence_locked(uint32_t fence);
+#endif
+
+/* The server is done with pixmap: trigger its idle fence and tell the
+ * client */
+static void
+mock_idle_locked(struct mock_window *w, xcb_pixmap_t pixmap, uint32_t serial,
+                 uint32_t fence)
+{
+#ifdef HAVE_XSHMFENCE
+        if (fence)
+                mock_trigger_fence_locked(fence);
+#endif
+
+        xcb_present_idle_notify_event_t ev = {
+                .response_type = XCB_GE_GENERIC,
+                .event_type = XCB_PRESENT_EVENT_IDLE_NOTIFY,
+                .window = w->window,
+                .serial = serial,
+                .pixmap = pixmap,
+                .idle_fence = fence,
+        };
+
+        ++stats.idles;
+        mock_send_locked(w, XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY,
+                         &ev, sizeof(ev));
+}
+
+static void
+mock_release_locked(struct mock_window *w, xcb_pixmap_t pixmap,
+                    uint32_t serial, uint32_t fence, uint64_t due_ns)
+{
+        struct mock_idle *idle = malloc(sizeof(*idle));
+        *idle = (struct mock_idle) {
+                .due_ns = due_ns,
+                .w = w,
+                .pixmap = pixmap,
+                .serial = serial,
+                .fence = fence,
+        };
+
+        /* Kept in due order */
+        struct mock_idle **link = &idles;
+        while (*link && ((*link)->due_ns <= due_ns))
+                link = &(*link)->next;
+        idle->next = *link;
+        *link = idle;
+}
+
+static void
+mock_show_locked(struct mock_present *p)
+{
+        struct mock_window *w = p->w;
+        uint64_t release = mock_now() + config.idle_us * 1000ull;
+
+        if (!p->pixmap) {
+                mock_complete_locked(w, 0, p->serial,
+                                     XCB_PRESENT_COMPLETE_MODE_COPY);
+                return;
+        }
+
+        if (config.flip) {
+                if (w->has_shown)
+                        mock_release_locked(w, w->shown_pixmap, w->shown_serial,
+                                            w->shown_fence, release);
+                w->has_shown = true;
+                w->shown_pixmap = p->pixmap;
+                w->shown_serial = p->serial;
+                w->shown_fence = p->idle_fence;
+        } else {
+                mock_release_locked(w, p->pixmap, p->serial, p->idle_fence,
+                                    release);
+        }
+
+        mock_complete_locked(w, p->pixmap, p->serial,
+                             config.flip ? XCB_PRESENT_COMPLETE_MODE_FLIP :
+                             XCB_PRESENT_COMPLETE_MODE_COPY);
+}
+
+static void
+mock_skip_locked(struct mock_present *p)
+{
+        mock_release_locked(p->w, p->pixmap, p->serial, p->idle_fence,
+                            mock_now());
+        mock_complete_locked(p->w, p->pixmap, p->serial,
+                             XCB_PRESENT_COMPLETE_MODE_SKIP);
+}
+
+/* Shows the presents that are due.  Of several for the same window only
+ * the last is shown, and the others are skipped. */
+static void
+mock_run_presents_locked(bool vblank)
+{
+        struct mock_present **link = &presents;
+
+        while (*link) {
+                struct mock_present *p = *link;
+
+                if (!p->immediate && (!vblank || (p->target_msc > msc))) {
+                        link = &p->next;
+                        continue;
+                }
+
+                *link = p->next;
+
+                bool replaced = false;
+                if (p->pixmap) {
+                        for (struct mock_present *n = p->next; n; n = n->next) {
+                                if ((n->w == p->w) && n->pixmap &&
+                                    (n->immediate ||
+                                     (vblank && (n->target_msc <= msc))))
+                                        replaced = true;
+                        }
+                }
+
+                if (replaced)
+                        mock_skip_locked(p);
+                else
+                        mock_show_locked(p);
+
+                free(p);
+        }
+}
+
+static void
+mock_run_idles_locked(uint64_t now)
+{
+        while (idles && (idles->due_ns <= now)) {
+                struct mock_idle *idle = idles;
+                idles = idle->next;
+
+                mock_idle_locked(idle->w, idle->pixmap, idle->serial,
+                                 idle->fence);
+                free(idle);
+        }
+}
+
+static void *
+mock_server(void *data)
+{
+        pthread_mutex_lock(&mock_lock);
+
+        while (!server_stop) {
+                uint64_t now = mock_now();
+                bool vblank = false;
+
+                if (config.refresh_us && (now >= next_vblank_ns)) {
+                        ++msc;
+                        next_vblank_ns += config.refresh_us * 1000ull;
+                        if (next_vblank_ns <= now)
+                                next_vblank_ns = now + config.refresh_us * 1000ull;
+                        vblank = true;
+                }
+
+                mock_run_presents_locked(vblank);
+                mock_run_idles_locked(now);
+
+                uint64_t wake = UINT64_MAX;
+                if (config.refresh_us)
+                        wake = next_vblank_ns;
+                if (idles && (idles->due_ns < wake))
+                        wake = idles->due_ns;
+
+                if (wake == UINT64_MAX) {
+                        pthread_cond_wait(&mock_server_cond, &mock_lock);
+                } else {
+                        struct timespec ts = {
+                                .tv_sec = wake / 1000000000,
+                                .tv_nsec = wake % 1000000000,
+                        };
+                        pthread_cond_timedwait(&mock_server_cond, &mock_lock, &ts);
+                }
+        }
+
+        pthread_mutex_unlock(&mock_lock);
+
+        return NULL;
+}
+
+void
+mock_init(const struct mock_config *c)
+{
+        if (c)
+                config = *c;
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&mock_server_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        stats.last_modifier = DRM_FORMAT_MOD_INVALID;
+        next_vblank_ns = mock_now() + config.refresh_us * 1000ull;
+        server_stop = false;
+        pthread_create(&server_thread, NULL, mock_server, NULL);
+}
+
+void
+mock_fini(void)
+{
+        pthread_mutex_lock(&mock_lock);
+        server_stop = true;
+        pthread_cond_signal(&mock_server_cond);
+        pthread_mutex_unlock(&mock_lock);
+
+        pthread_join(server_thread, NULL);
+        pthread_cond_destroy(&mock_server_cond);
+}
+
+void
+mock_get_stats(struct mock_stats *s)
+{
+        pthread_mutex_lock(&mock_lock);
+        *s = stats;
+        pthread_mutex_unlock(&mock_lock);
+}
+
+/* Connections */
+
+xcb_connection_t *
+mock_connect(void)
+{
+        xcb_connection_t *conn = calloc(1, sizeof(*conn));
+        conn->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        return conn;
+}
+
+void
+xcb_disconnect(xcb_connection_t *conn)
+{
+        pthread_mutex_lock(&mock_lock);
+        for (struct mock_window *w = windows; w; w = w->next) {
+                for (unsigned i = 0; i < w->num_selections;) {
+                        if (w->selections[i].conn == conn)
+                                w->selections[i] = w->selections[--w->num_selections];
+                        else
+                                ++i;
+                }
+        }
+        pthread_mutex_unlock(&mock_lock);
+
+        close(conn->event_fd);
+        free(conn);
+}
+
+int
+xcb_connection_has_error(xcb_connection_t *conn)
+{
+        return 0;
+}
+
+int
+xcb_get_file_descriptor(xcb_connection_t *conn)
+{
+        return conn->event_fd;
+}
+
+uint32_t
+xcb_generate_id(xcb_connection_t *conn)
+{
+        return atomic_fetch_add(&next_xid, 1);
+}
+
+/* Special event queues */
+
+xcb_special_event_t *
+xcb_register_for_special_xge(xcb_connection_t *conn, xcb_extension_t *ext,
+                             uint32_t eid, uint32_t *stamp)
+{
+        xcb_special_event_t *se = calloc(1, sizeof(*se));
+        se->conn = conn;
+        se->eid = eid;
+        se->tail = &se->head;
+
+        pthread_mutex_lock(&mock_lock);
+        se->next = queues;
+        queues = se;
+        pthread_mutex_unlock(&mock_lock);
+
+        return se;
+}
+
+void
+xcb_unregister_for_special_event(xcb_connection_t *conn,
+                                 xcb_special_event_t *se)
+{
+        pthread_mutex_lock(&mock_lock);
+        for (struct xcb_special_event **link = &queues; *link;
+             link = &(*link)->next) {
+                if (*link == se) {
+                        *link = se->next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&mock_lock);
+
+        while (se->head) {
+                struct mock_event *e = se->head;
+                se->head = e->next;
+                free(e->ev);
+                free(e);
+        }
+        free(se);
+}
+
+/* Reading any event drains the socket into the queues, as libxcb does */
+static xcb_generic_event_t *
+mock_take_event_locked(xcb_connection_t *conn, xcb_special_event_t *se)
+{
+        eventfd_t count;
+        eventfd_read(conn->event_fd, &count);
+
+        struct mock_event *e = se->head;
+        if (!e)
+                return NULL;
+
+        se->head = e->next;
+        if (!se->head)
+                se->tail = &se->head;
+
+        xcb_generic_event_t *ev = e->ev;
+        free(e);
+        return ev;
+}
+
+xcb_generic_event_t *
+xcb_poll_for_special_event(xcb_connection_t *conn, xcb_special_event_t *se)
+{
+        pthread_mutex_lock(&mock_lock);
+        xcb_generic_event_t *ev = mock_take_event_locked(conn, se);
+        pthread_mutex_unlock(&mock_lock);
+
+        return ev;
+}
+
+xcb_generic_event_t *
+xcb_wait_for_special_event(xcb_connection_t *conn, xcb_special_event_t *se)
+{
+        pthread_mutex_lock(&mock_lock);
+        xcb_generic_event_t *ev;
+        while (!(ev = mock_take_event_locked(conn, se)))
+                pthread_cond_wait(&mock_event_cond, &mock_lock);
+        pthread_mutex_unlock(&mock_lock);
+
+        return ev;
+}
+
+/* Windows */
+
+xcb_window_t
+mock_create_window(xcb_connection_t *conn, uint16_t width, uint16_t height)
+{
+        struct mock_window *w = calloc(1, sizeof(*w));
+        w->window = xcb_generate_id(conn);
+        w->width = width;
+        w->height = height;
+
+        pthread_mutex_lock(&mock_lock);
+        w->next = windows;
+        windows = w;
+        pthread_mutex_unlock(&mock_lock);
+
+        return w->window;
+}
+
+void
+mock_resize_window(xcb_window_t window, uint16_t width, uint16_t height)
+{
+        pthread_mutex_lock(&mock_lock);
+        struct mock_window *w = mock_find_window_locked(window);
+
+        if (w && ((w->width != width) || (w->height != height))) {
+                w->width = width;
+                w->height = height;
+
+                xcb_present_configure_notify_event_t ev = {
+                        .response_type = XCB_GE_GENERIC,
+                        .event_type = XCB_PRESENT_EVENT_CONFIGURE_NOTIFY,
+                        .window = window,
+                        .width = width,
+                        .height = height,
+                };
+                mock_send_locked(w, XCB_PRESENT_EVENT_MASK_CONFIGURE_NOTIFY,
+                                 &ev, sizeof(ev));
+        }
+        pthread_mutex_unlock(&mock_lock);
+}
+
+xcb_get_geometry_cookie_t
+xcb_get_geometry(xcb_connection_t *conn, xcb_drawable_t drawable)
+{
+        mock_request();
+        return (xcb_get_geometry_cookie_t) { .sequence = drawable };
+}
+
+xcb_get_geometry_reply_t *
+xcb_get_geometry_reply(xcb_connection_t *conn, xcb_get_geometry_cookie_t cookie,
+                       xcb_generic_error_t **e)
+{
+        mock_round_trip();
+
+        if (e)
+                *e = NULL;
+
+        pthread_mutex_lock(&mock_lock);
+        struct mock_window *w = mock_find_window_locked(cookie.sequence);
+        xcb_get_geometry_reply_t *reply = NULL;
+        if (w) {
+                reply = calloc(1, sizeof(*reply));
+                reply->response_type = XCB_GET_GEOMETRY;
+                reply->depth = 24;
+                reply->width = w->width;
+                reply->height = w->height;
+        }
+        pthread_mutex_unlock(&mock_lock);
+
+        return reply;
+}
+
+/* Core requests without replies */
+
+#define MOCK_VOID_REQUEST(name, ...) \
+        xcb_void_cookie_t name(__VA_ARGS__) \
+        { \
+                mock_request(); \
+                return (xcb_void_cookie_t) { .sequence = 0 }; \
+        }
+
+MOCK_VOID_REQUEST(xcb_create_gc, xcb_connection_t *conn, xcb_gcontext_t gc,
+                  xcb_drawable_t drawable, uint32_t mask, const void *values)
+MOCK_VOID_REQUEST(xcb_change_gc, xcb_connection_t *conn, xcb_gcontext_t gc,
+                  uint32_t mask, const void *values)
+MOCK_VOID_REQUEST(xcb_free_gc, xcb_connection_t *conn, xcb_gcontext_t gc)
+MOCK_VOID_REQUEST(xcb_copy_area, xcb_connection_t *conn, xcb_drawable_t src,
+                  xcb_drawable_t dst, xcb_gcontext_t gc, int16_t src_x,
+                  int16_t src_y, int16_t dst_x, int16_t dst_y,
+                  uint16_t width, uint16_t height)
+MOCK_VOID_REQUEST(xcb_xfixes_create_region, xcb_connection_t *conn,
+                  xcb_xfixes_region_t region, uint32_t n,
+                  const xcb_rectangle_t *rects)
+MOCK_VOID_REQUEST(xcb_xfixes_set_region, xcb_connection_t *conn,
+                  xcb_xfixes_region_t region, uint32_t n,
+                  const xcb_rectangle_t *rects)
+MOCK_VOID_REQUEST(xcb_xfixes_union_region, xcb_connection_t *conn,
+                  xcb_xfixes_region_t a, xcb_xfixes_region_t b,
+                  xcb_xfixes_region_t dst)
+MOCK_VOID_REQUEST(xcb_xfixes_copy_region, xcb_connection_t *conn,
+                  xcb_xfixes_region_t src, xcb_xfixes_region_t dst)
+MOCK_VOID_REQUEST(xcb_xfixes_destroy_region, xcb_connection_t *conn,
+                  xcb_xfixes_region_t region)
+MOCK_VOID_REQUEST(xcb_xfixes_set_gc_clip_region, xcb_connection_t *conn,
+                  xcb_gcontext_t gc, xcb_xfixes_region_t region,
+                  int16_t x, int16_t y)
+
+xcb_void_cookie_t
+xcb_free_pixmap(xcb_connection_t *conn, xcb_pixmap_t pixmap)
+{
+        pthread_mutex_lock(&mock_lock);
+        ++stats.requests;
+        --stats.live_pixmaps;
+        pthread_mutex_unlock(&mock_lock);
+
+        return (xcb_void_cookie_t) { .sequence = 0 };
+}
+
+/* Extension versions */
+
+xcb_present_query_version_cookie_t
+xcb_present_query_version(xcb_connection_t *conn, uint32_t major, uint32_t minor)
+{
+        mock_request();
+        return (xcb_present_query_version_cookie_t) { .sequence = 1 };
+}
+
+xcb_present_query_version_reply_t *
+xcb_present_query_version_reply(xcb_connection_t *conn,
+                                xcb_present_query_version_cookie_t cookie,
+                                xcb_generic_error_t **e)
+{
+        mock_round_trip();
+
+        if (e)
+                *e = NULL;
+
+        /* As xcb does for a request to a missing extension */
+        if (config.no_present)
+                return NULL;
+
+        xcb_present_query_version_reply_t *reply = calloc(1, sizeof(*reply));
+        reply->major_version = 1;
+        reply->minor_version = 2;
+
+        return reply;
+}
+
+xcb_dri3_query_version_cookie_t
+xcb_dri3_query_version(xcb_connection_t *conn, uint32_t major, uint32_t minor)
+{
+        mock_request();
+        return (xcb_dri3_query_version_cookie_t) { .sequence = 1 };
+}
+
+xcb_dri3_query_version_reply_t *
+xcb_dri3_query_version_reply(xcb_connection_t *conn,
+                             xcb_dri3_query_version_cookie_t cookie,
+                             xcb_generic_error_t **e)
+{
+        mock_round_trip();
+
+        xcb_dri3_query_version_reply_t *reply = calloc(1, sizeof(*reply));
+        reply->major_version = 1;
+        reply->minor_version = config.dri3_minor;
+
+        if (e)
+                *e = NULL;
+        return reply;
+}
+
+xcb_xfixes_query_version_cookie_t
+xcb_xfixes_query_version(xcb_connection_t *conn, uint32_t major, uint32_t minor)
+{
+        mock_request();
+        return (xcb_xfixes_query_version_cookie_t) { .sequence = 1 };
+}
+
+xcb_xfixes_query_version_reply_t *
+xcb_xfixes_query_version_reply(xcb_connection_t *conn,
+                               xcb_xfixes_query_version_cookie_t cookie,
+                               xcb_generic_error_t **e)
+{
+        mock_round_trip();
+
+        xcb_xfixes_query_version_reply_t *reply = calloc(1, sizeof(*reply));
+        reply->major_version = 5;
+
+        if (e)
+                *e = NULL;
+        return reply;
+}
+
+/* DRI3 */
+
+xcb_dri3_open_cookie_t
+xcb_dri3_open(xcb_connection_t *conn, xcb_drawable_t drawable, uint32_t provider)
+{
+        mock_request();
+        return (xcb_dri3_open_cookie_t) { .sequence = 1 };
+}
+
+/* The fd follows the reply, where libxcb keeps it */
+xcb_dri3_open_reply_t *
+xcb_dri3_open_reply(xcb_connection_t *conn, xcb_dri3_open_cookie_t cookie,
+                    xcb_generic_error_t **e)
+{
+        mock_round_trip();
+
+        xcb_dri3_open_reply_t *reply = calloc(1, sizeof(*reply) + sizeof(int));
+        reply->nfd = 1;
+        *(int *) (reply + 1) = mock_drm_open();
+
+        if (e)
+                *e = NULL;
+        return reply;
+}
+
+int *
+xcb_dri3_open_reply_fds(xcb_connection_t *conn, xcb_dri3_open_reply_t *reply)
+{
+        return (int *) (reply + 1);
+}
+
+/* The server owns fds sent with a request, and closes its copy */
+xcb_void_cookie_t
+xcb_dri3_pixmap_from_buffer(xcb_connection_t *conn, xcb_pixmap_t pixmap,
+                            xcb_drawable_t drawable, uint32_t size,
+                            uint16_t width, uint16_t height, uint16_t stride,
+                            uint8_t depth, uint8_t bpp, int32_t fd)
+{
+        close(fd);
+
+        pthread_mutex_lock(&mock_lock);
+        ++stats.requests;
+        ++stats.live_pixmaps;
+        pthread_mutex_unlock(&mock_lock);
+
+        return (xcb_void_cookie_t) { .sequence = 0 };
+}
+
+xcb_void_cookie_t
+xcb_dri3_pixmap_from_buffers(xcb_connection_t *conn, xcb_pixmap_t pixmap,
+                             xcb_window_t window, uint8_t num_buffers,
+                             uint16_t width, uint16_t height,
+                             uint32_t stride0, uint32_t offset0,
+                             uint32_t stride1, uint32_t offset1,
+                             uint32_t stride2, uint32_t offset2,
+                             uint32_t stride3, uint32_t offset3,
+                             uint8_t depth, uint8_t bpp, uint64_t modifier,
+                             const int32_t *fds)
+{
+        for (unsigned i = 0; i < num_buffers; ++i)
+                close(fds[i]);
+
+        pthread_mutex_lock(&mock_lock);
+        ++stats.requests;
+        ++stats.live_pixmaps;
+        stats.last_modifier = modifier;
+        pthread_mutex_unlock(&mock_lock);
+
+        return (xcb_void_cookie_t) { .sequence = 0 };
+}
+
+xcb_dri3_get_supported_modifiers_cookie_t
+xcb_dri3_get_supported_modifiers(xcb_connection_t *conn, uint32_t window,
+                                 uint8_t depth, uint8_t bpp)
+{
+        mock_request();
+        return (xcb_dri3_get_supported_modifiers_cookie_t) { .sequence = 1 };
+}
+
+/* The window modifiers follow the reply; there are no screen modifiers */
+xcb_dri3_get_supported_modifiers_reply_t *
+xcb_dri3_get_supported_modifiers_reply(xcb_connection_t *conn,
+                                       xcb_dri3_get_supported_modifiers_cookie_t cookie,
+                                       xcb_generic_error_t **e)
+{
+        mock_round_trip();
+
+        xcb_dri3_get_supported_modifiers_reply_t *reply =
+                calloc(1, sizeof(*reply) + config.num_modifiers * sizeof(uint64_t));
+        reply->num_window_modifiers = config.num_modifiers;
+        if (config.num_modifiers)
+                memcpy(reply + 1, config.modifiers,
+                       config.num_modifiers * sizeof(uint64_t));
+
+        if (e)
+                *e = NULL;
+        return reply;
+}
+
+uint64_t *
+xcb_dri3_get_supported_modifiers_window_modifiers(const xcb_dri3_get_supported_modifiers_reply_t *reply)
+{
+        return (uint64_t *) (reply + 1);
+}
+
+int
+xcb_dri3_get_supported_modifiers_window_modifiers_length(const xcb_dri3_get_supported_modifiers_reply_t *reply)
+{
+        return reply->num_window_modifiers;
+}
+
+uint64_t *
+xcb_dri3_get_supported_modifiers_screen_modifiers(const xcb_dri3_get_supported_modifiers_reply_t *reply)
+{
+        return (uint64_t *) (reply + 1) + reply->num_window_modifiers;
+}
+
+int
+xcb_dri3_get_supported_modifiers_screen_modifiers_length(const xcb_dri3_get_supported_modifiers_reply_t *reply)
+{
+        return reply->num_screen_modifiers;
+}
+
+/* Present */
+
+/* A new mask replaces the one eid had, and no events deselects it */
+xcb_void_cookie_t
+xcb_present_select_input(xcb_connection_t *conn, xcb_present_event_t eid,
+                         xcb_window_t window, uint32_t mask)
+{
+        pthread_mutex_lock(&mock_lock);
+        ++stats.requests;
+
+        struct mock_window *w = mock_find_window_locked(window);
+        if (w) {
+                unsigned i = 0;
+                while ((i < w->num_selections) &&
+                       ((w->selections[i].conn != conn) ||
+                        (w->selections[i].eid != eid)))
+                        ++i;
+
+                if (!mask) {
+                        if (i < w->num_selections)
+                                w->selections[i] = w->selections[--w->num_selections];
+                } else if (i < MOCK_MAX_SELECTIONS) {
+                        w->selections[i].conn = conn;
+                        w->selections[i].eid = eid;
+                        w->selections[i].mask = mask;
+                        if (i == w->num_selections)
+                                ++w->num_selections;
+                }
+        }
+        pthread_mutex_unlock(&mock_lock);
+
+        return (xcb_void_cookie_t) { .sequence = 0 };
+}
+
+/* As the server does, a target that has passed means the next MSC that
+ * matches divisor/remainder, or just the next one */
+static uint64_t
+mock_target_msc_locked(uint64_t target, uint64_t divisor, uint64_t remainder)
+{
+        if (target > msc)
+                return target;
+
+        if (!divisor)
+                return msc + 1;
+
+        uint64_t t = msc - msc % divisor + remainder;
+        if (t <= msc)
+                t += divisor;
+        return t;
+}
+
+static void
+mock_queue_present(xcb_window_t window, xcb_pixmap_t pixmap, uint32_t serial,
+                   uint32_t idle_fence, bool async, uint64_t target_msc,
+                   uint64_t divisor, uint64_t remainder)
+{
+        pthread_mutex_lock(&mock_lock);
+        ++stats.requests;
+        if (pixmap)
+                ++stats.presents;
+
+        struct mock_window *w = mock_find_window_locked(window);
+        if (w) {
+                struct mock_present *p = malloc(sizeof(*p));
+                *p = (struct mock_present) {
+                        .w = w,
+                        .pixmap = pixmap,
+                        .serial = serial,
+                        .idle_fence = idle_fence,
+                        .immediate = async || !config.refresh_us,
+                        .target_msc = mock_target_msc_locked(target_msc, divisor,
+                                                             remainder),
+                };
+
+                struct mock_present **link = &presents;
+                while (*link)
+                        link = &(*link)->next;
+                *link = p;
+
+                if (p->immediate)
+                        pthread_cond_signal(&mock_server_cond);
+        }
+        pthread_mutex_unlock(&mock_lock);
+}
+
+xcb_void_cookie_t
+xcb_present_pixmap(xcb_connection_t *conn, xcb_window_t window,
+                   xcb_pixmap_t pixmap, uint32_t serial,
+                   xcb_xfixes_region_t valid, xcb_xfixes_region_t update,
+                   int16_t x_off, int16_t y_off, xcb_randr_crtc_t target_crtc,
+                   xcb_sync_fence_t wait_fence, xcb_sync_fence_t idle_fence,
+                   uint32_t options, uint64_t target_msc, uint64_t divisor,
+                   uint64_t remainder, uint32_t notifies_len,
+                   const xcb_present_notify_t *notifies)
+{
+        mock_queue_present(window, pixmap, serial, idle_fence,
+                           options & XCB_PRESENT_OPTION_ASYNC,
+                           target_msc, divisor, remainder);
+
+        return (xcb_void_cookie_t) { .sequence = 0 };
+}
+
+xcb_void_cookie_t
+xcb_present_notify_msc(xcb_connection_t *conn, xcb_window_t window,
+                       uint32_t serial, uint64_t target_msc, uint64_t divisor,
+                       uint64_t remainder)
+{
+        mock_queue_present(window, 0, serial, 0, false,
+                           target_msc, divisor, remainder);
+
+        return (xcb_void_cookie_t) { .sequence = 0 };
+}
+
+#ifdef HAVE_XSHMFENCE
+
+/* Fences live in process memory; the fd only names one until the server
+ * has it.  Each fence is referenced by its mapping and its XID. */
+struct xshmfence {
+        atomic_int triggered;
+        atomic_int refs;
+        int fd;
+        uint32_t xid;
+        struct xshmfence *next;
+};
+
+static struct xshmfence *fences;
+
+static void
+mock_unref_fence_locked(struct xshmfence *f)
+{
+        if (atomic_fetch_sub(&f->refs, 1) != 1)
+                return;
+
+        for (struct xshmfence **link = &fences; *link; link = &(*link)->next) {
+                if (*link == f) {
+                        *link = f->next;
+                        break;
+                }
+        }
+        free(f);
+}
+
+static void
+mock_trigger_fence_locked(uint32_t xid)
+{
+        for (struct xshmfence *f = fences; f; f = f->next) {
+                if (f->xid == xid)
+                        atomic_store(&f->triggered, 1);
+        }
+}
+
+int
+xshmfence_alloc_shm(void)
+{
+        int fd = memfd_create("mock-xshmfence", MFD_CLOEXEC);
+        if (fd < 0)
+                return fd;
+
+        struct xshmfence *f = calloc(1, sizeof(*f));
+        f->fd = fd;
+
+        pthread_mutex_lock(&mock_lock);
+        f->next = fences;
+        fences = f;
+        pthread_mutex_unlock(&mock_lock);
+
+        return fd;
+}
+
+struct xshmfence *
+xshmfence_map_shm(int fd)
+{
+        struct xshmfence *found = NULL;
+
+        pthread_mutex_lock(&mock_lock);
+        for (struct xshmfence *f = fences; f; f = f->next) {
+                if (f->fd == fd) {
+                        atomic_fetch_add(&f->refs, 1);
+                        found = f;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&mock_lock);
+
+        return found;
+}
+
+void
+xshmfence_unmap_shm(struct xshmfence *f)
+{
+        pthread_mutex_lock(&mock_lock);
+        mock_unref_fence_locked(f);
+        pthread_mutex_unlock(&mock_lock);
+}
+
+int
+xshmfence_query(struct xshmfence *f)
+{
+        return atomic_load(&f->triggered);
+}
+
+void
+xshmfence_reset(struct xshmfence *f)
+{
+        atomic_store(&f->triggered, 0);
+}
+
+int
+xshmfence_trigger(struct xshmfence *f)
+{
+        atomic_store(&f->triggered, 1);
+        return 0;
+}
+
+int
+xshmfence_await(struct xshmfence *f)
+{
+        while (!atomic_load(&f->triggered))
+                mock_sleep_us(50);
+        return 0;
+}
+
+xcb_void_cookie_t
+xcb_dri3_fence_from_fd(xcb_connection_t *conn, xcb_drawable_t drawable,
+                       uint32_t fence, uint8_t initially_triggered,
+                       int32_t fence_fd)
+{
+        pthread_mutex_lock(&mock_lock);
+        ++stats.requests;
+        for (struct xshmfence *f = fences; f; f = f->next) {
+                if (f->fd == fence_fd) {
+                        atomic_fetch_add(&f->refs, 1);
+                        atomic_store(&f->triggered, initially_triggered);
+                        f->xid = fence;
+                        f->fd = -1;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&mock_lock);
+
+        close(fence_fd);
+
+        return (xcb_void_cookie_t) { .sequence = 0 };
+}
+
+xcb_void_cookie_t
+xcb_sync_destroy_fence(xcb_connection_t *conn, xcb_sync_fence_t fence)
+{
+        pthread_mutex_lock(&mock_lock);
+        ++stats.requests;
+        for (struct xshmfence *f = fences; f; f = f->next) {
+                if (f->xid == fence) {
+                        f->xid = 0;
+                        mock_unref_fence_locked(f);
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&mock_lock);
+
+        return (xcb_void_cookie_t) { .sequence = 0 };
+}
+
+#endif
+
+/* DRM */
+
+int
+mock_drm_open(void)
+{
+        int fd = memfd_create("mock-drm", MFD_CLOEXEC);
+
+        if ((fd >= 0) && (fd < MOCK_MAX_FDS))
+                drm_fds[fd] = true;
+
+        return fd;
+}
+
+static int
+mock_drm_ioctl(unsigned long request, void *arg)
+{
+        switch (request) {
+        case DRM_IOCTL_GET_MAGIC: {
+                struct drm_auth *auth = arg;
+                auth->magic = 1;
+                return 0;
+        }
+        case DRM_IOCTL_MODE_CREATE_DUMB: {
+                struct drm_mode_create_dumb *create = arg;
+
+                mock_sleep_us(config.alloc_us);
+
+                create->handle = atomic_fetch_add(&next_handle, 1);
+                create->pitch = (create->width * create->bpp / 8 + 63) & ~63;
+                create->size = (uint64_t) create->pitch * create->height;
+
+                pthread_mutex_lock(&mock_lock);
+                ++stats.allocs;
+                ++stats.live_bos;
+                pthread_mutex_unlock(&mock_lock);
+                return 0;
+        }
+        case DRM_IOCTL_PRIME_HANDLE_TO_FD: {
+                struct drm_prime_handle *prime = arg;
+                prime->fd = memfd_create("mock-dmabuf", MFD_CLOEXEC);
+                return prime->fd < 0 ? -1 : 0;
+        }
+        case DRM_IOCTL_GEM_CLOSE:
+                pthread_mutex_lock(&mock_lock);
+                ++stats.frees;
+                --stats.live_bos;
+                pthread_mutex_unlock(&mock_lock);
+                return 0;
+        default:
+                return 0;
+        }
+}
+
+int
+mock_ioctl(int fd, unsigned long request, void *arg)
+{
+        if ((fd >= 0) && (fd < MOCK_MAX_FDS) && drm_fds[fd]) {
+                if (_IOC_TYPE(request) == DRM_IOCTL_BASE)
+                        return mock_drm_ioctl(request, arg);
+                return 0;
+        }
+
+        return syscall(SYS_ioctl, fd, request, arg);
+}
+
+/* What libdri2to3's interposer finds as the next ioctl */
+int
+ioctl(int fd, unsigned long request, ...)
+{
+        va_list args;
+        va_start(args, request);
+        void *arg = va_arg(args, void *);
+        va_end(args);
+
+        return mock_ioctl(fd, request, arg);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MOCK_INCLUDE_GUARD
+#define MOCK_INCLUDE_GUARD
+
+/* A stand-in for the X server and the DRM device, so that libdri2to3 can
+ * run without a display or a GPU.
+ *
+ * Tests link it after libdri2to3, so the xcb functions the library calls
+ * resolve here, and so does the ioctl its interposer forwards to.
+ * The "server" runs on its own thread: it completes presents at simulated
+ * vblanks and sends IdleNotify after a configurable delay. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <xcb/xcb.h>
+
+struct mock_config {
+        /* Round trip of each request with a reply */
+        unsigned reply_us;
+        /* Time taken by DRM_IOCTL_MODE_CREATE_DUMB */
+        unsigned alloc_us;
+        /* Vblank period; 0 completes every present straight away */
+        unsigned refresh_us;
+        /* From a buffer leaving the screen until its IdleNotify */
+        unsigned idle_us;
+        /* A shown buffer stays busy until the next present replaces it,
+         * as with page flips; otherwise it is copied and released */
+        bool flip;
+        /* The server lacks the Present extension */
+        bool no_present;
+
+        /* DRI3 minor version; 2 and up allows modifiers */
+        uint32_t dri3_minor;
+        /* Reported by GetSupportedModifiers for every window */
+        const uint64_t *modifiers;
+        unsigned num_modifiers;
+};
+
+struct mock_stats {
+        uint64_t requests;
+        uint64_t round_trips;
+
+        uint64_t presents;
+        uint64_t completes;
+        uint64_t skips;
+        uint64_t idles;
+
+        uint64_t allocs;
+        uint64_t frees;
+        int64_t live_bos;
+        int64_t live_pixmaps;
+
+        /* Of the last PixmapFromBuffers, DRM_FORMAT_MOD_INVALID before
+         * the first */
+        uint64_t last_modifier;
+};
+
+/* Starts the server thread; config may be NULL for the defaults */
+void
+mock_init(const struct mock_config *config);
+
+void
+mock_fini(void);
+
+xcb_connection_t *
+mock_connect(void);
+
+xcb_window_t
+mock_create_window(xcb_connection_t *conn, uint16_t width, uint16_t height);
+
+/* Sends ConfigureNotify if the size changes */
+void
+mock_resize_window(xcb_window_t window, uint16_t width, uint16_t height);
+
+/* A DRM device as the client driver opens it */
+int
+mock_drm_open(void);
+
+/* The stand-in for the ioctl syscall, without the interposer in front */
+int
+mock_ioctl(int fd, unsigned long request, void *arg);
+
+void
+mock_get_stats(struct mock_stats *stats);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Checks the modifier a buffer is created with, for the modifiers the
+ * server advertises and those set with DRI2TO3_MODIFIERS.  Needs the test
+ * build of the library and DRI2TO3_ALLOCATOR=stub, whose buffers take the
+ * first modifier of the negotiated list. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+
+#include "client.h"
+
+#define MAX_MODIFIERS 16
+
+static void
+usage(const char *argv0)
+{
+        fprintf(stderr, "usage: %s [-s server modifiers] [-v DRI3 minor] "
+                "-e expected modifier\n", argv0);
+        exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+        uint64_t modifiers[MAX_MODIFIERS];
+        struct mock_config config = {
+                .dri3_minor = 2,
+                .modifiers = modifiers,
+        };
+        uint64_t expected = DRM_FORMAT_MOD_INVALID;
+        bool has_expected = false;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "s:v:e:")) != -1) {
+                switch (opt) {
+                case 's': {
+                        /* The format of DRI2TO3_MODIFIERS */
+                        char *end;
+                        for (const char *s = optarg;
+                             *s && (config.num_modifiers < MAX_MODIFIERS);
+                             s = *end ? end + 1 : end)
+                                modifiers[config.num_modifiers++] =
+                                        strtoull(s, &end, 16);
+                        break;
+                }
+                case 'v':
+                        config.dri3_minor = strtoul(optarg, NULL, 0);
+                        break;
+                case 'e':
+                        expected = strtoull(optarg, NULL, 16);
+                        has_expected = true;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+
+        if (!has_expected)
+                usage(argv[0]);
+
+        mock_init(&config);
+        xcb_connection_t *conn = mock_connect();
+
+        xcb_window_t window = mock_create_window(conn, 64, 64);
+        int drm_fd = client_connect(conn, window);
+        xcb_dri2_create_drawable_checked(conn, window);
+
+        bool ok = client_frame(conn, window, drm_fd);
+
+        struct mock_stats stats;
+        mock_get_stats(&stats);
+
+        xcb_dri2_destroy_drawable_checked(conn, window);
+        xcb_disconnect(conn);
+        mock_fini();
+
+        if (!ok) {
+                fprintf(stderr, "frame failed\n");
+                return 1;
+        }
+
+        if (stats.last_modifier != expected) {
+                fprintf(stderr, "buffer has modifier %llx, expected %llx\n",
+                        (unsigned long long) stats.last_modifier,
+                        (unsigned long long) expected);
+                return 1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Without Present on the server, DRI2 has to fail cleanly: Connect
+ * returns no reply and the drawable calls that follow anyway must neither
+ * crash nor allocate. */
+
+#include <stdio.h>
+
+#include "client.h"
+
+int
+main(int argc, char **argv)
+{
+        struct mock_config config = {
+                .no_present = true,
+        };
+
+        mock_init(&config);
+        xcb_connection_t *conn = mock_connect();
+        xcb_window_t window = mock_create_window(conn, 64, 64);
+
+        xcb_dri2_connect_reply_t *reply =
+                xcb_dri2_connect_reply(conn, xcb_dri2_connect(conn, window, 0),
+                                       NULL);
+        free(reply);
+
+        int drm_fd = client_connect(conn, window);
+        xcb_dri2_create_drawable_checked(conn, window);
+        bool ok = client_frame(conn, window, drm_fd);
+        xcb_dri2_destroy_drawable_checked(conn, window);
+
+        struct mock_stats stats;
+        mock_get_stats(&stats);
+
+        xcb_disconnect(conn);
+        mock_fini();
+
+        if (reply) {
+                fprintf(stderr, "Connect succeeded without Present\n");
+                return 1;
+        }
+
+        if (ok || stats.allocs) {
+                fprintf(stderr, "a frame was drawn without Present\n");
+                return 1;
+        }
+
+        return 0;
+}
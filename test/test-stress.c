@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Threads render to their own windows while also poking one shared window
+ * through every entry point that takes its lock, and another thread keeps
+ * creating and destroying drawables under the lock-free lookups */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dri2to3.h"
+#include "client.h"
+
+#define THREADS 4
+#define WINDOWS_PER_THREAD 2
+#define ITERATIONS 300
+
+static xcb_connection_t *conn;
+static int drm_fd;
+
+static xcb_window_t shared;
+static xcb_window_t windows[THREADS][WINDOWS_PER_THREAD];
+
+static void
+fail(const char *what, unsigned t, unsigned i)
+{
+        fprintf(stderr, "thread %u, iteration %u: %s failed\n", t, i, what);
+        exit(1);
+}
+
+/* Only thread 0 renders to the shared window: the driver's GEM handles
+ * for a drawable belong to a single context */
+static void
+poke_shared(unsigned t, unsigned i)
+{
+        switch ((i + t) % 5) {
+        case 0:
+                free(xcb_dri2_copy_region_reply(conn,
+                                                xcb_dri2_copy_region(conn, shared, 0,
+                                                                     XCB_DRI2_ATTACHMENT_BUFFER_FRONT_LEFT,
+                                                                     XCB_DRI2_ATTACHMENT_BUFFER_BACK_LEFT),
+                                                NULL));
+                break;
+        case 1: {
+                xcb_dri2_get_msc_reply_t *reply =
+                        xcb_dri2_get_msc_reply(conn, xcb_dri2_get_msc(conn, shared),
+                                               NULL);
+                if (!reply)
+                        fail("GetMSC", t, i);
+                free(reply);
+                break;
+        }
+        case 2: {
+                xcb_rectangle_t rect = { t * 8, 0, 8, 8 };
+                if (dri2to3_set_damage(conn, shared, 1, &rect))
+                        fail("set_damage", t, i);
+                break;
+        }
+        case 3:
+                if (dri2to3_set_buffer_count(conn, shared, (i / 5) % 4 ? 2 + t % 3 : 0))
+                        fail("set_buffer_count", t, i);
+                break;
+        case 4: {
+                struct dri2to3_drawable_stats stats;
+                if (dri2to3_get_drawable_stats(conn, shared, &stats))
+                        fail("get_drawable_stats", t, i);
+                break;
+        }
+        }
+}
+
+static void *
+run_thread(void *data)
+{
+        unsigned t = (uintptr_t) data;
+
+        for (unsigned i = 0; i < ITERATIONS; ++i) {
+                for (unsigned j = 0; j < WINDOWS_PER_THREAD; ++j) {
+                        xcb_window_t w = windows[t][j];
+
+                        if (!(i % 23))
+                                dri2to3_set_buffer_count(conn, w, (i / 23) % 4);
+                        if (!(i % 29))
+                                dri2to3_set_max_wait(conn, w, (i / 29) & 1);
+                        if (!(i % 17))
+                                mock_resize_window(w, 64 + (i & 16), 64);
+
+                        if (!client_frame(conn, w, drm_fd))
+                                fail("frame", t, i);
+                }
+
+                if (!t && !client_frame(conn, shared, drm_fd))
+                        fail("shared frame", t, i);
+
+                poke_shared(t, i);
+        }
+
+        return NULL;
+}
+
+static void *
+run_churn(void *data)
+{
+        for (unsigned i = 0; i < ITERATIONS; ++i) {
+                xcb_window_t w = mock_create_window(conn, 32, 32);
+
+                xcb_dri2_create_drawable_checked(conn, w);
+                for (unsigned f = 0; f < i % 3; ++f) {
+                        if (!client_frame(conn, w, drm_fd))
+                                fail("churn frame", THREADS, i);
+                }
+                xcb_dri2_destroy_drawable_checked(conn, w);
+        }
+
+        return NULL;
+}
+
+static bool
+check_frames(xcb_window_t w, uint64_t expected)
+{
+        struct dri2to3_drawable_stats stats;
+
+        if (dri2to3_get_drawable_stats(conn, w, &stats) ||
+            (stats.frames != expected)) {
+                fprintf(stderr, "window %x swapped %llu of %llu frames\n", w,
+                        (unsigned long long) stats.frames,
+                        (unsigned long long) expected);
+                return false;
+        }
+
+        return true;
+}
+
+int
+main(void)
+{
+        struct mock_config config = {
+                .refresh_us = 500,
+                .idle_us = 100,
+                .dri3_minor = 2,
+        };
+
+        mock_init(&config);
+        conn = mock_connect();
+
+        for (unsigned t = 0; t < THREADS; ++t) {
+                for (unsigned j = 0; j < WINDOWS_PER_THREAD; ++j)
+                        windows[t][j] = mock_create_window(conn, 64, 64);
+        }
+
+        drm_fd = client_connect(conn, windows[0][0]);
+
+        for (unsigned t = 0; t < THREADS; ++t) {
+                for (unsigned j = 0; j < WINDOWS_PER_THREAD; ++j)
+                        xcb_dri2_create_drawable_checked(conn, windows[t][j]);
+        }
+
+        shared = mock_create_window(conn, 64, 64);
+        xcb_dri2_create_drawable_checked(conn, shared);
+
+        pthread_t threads[THREADS + 1];
+
+        for (unsigned t = 0; t < THREADS; ++t)
+                pthread_create(&threads[t], NULL, run_thread,
+                               (void *) (uintptr_t) t);
+        pthread_create(&threads[THREADS], NULL, run_churn, NULL);
+
+        for (unsigned t = 0; t <= THREADS; ++t)
+                pthread_join(threads[t], NULL);
+
+        bool ok = check_frames(shared, ITERATIONS);
+
+        for (unsigned t = 0; t < THREADS; ++t) {
+                for (unsigned j = 0; j < WINDOWS_PER_THREAD; ++j) {
+                        ok &= check_frames(windows[t][j], ITERATIONS);
+                        xcb_dri2_destroy_drawable_checked(conn, windows[t][j]);
+                }
+        }
+
+        xcb_dri2_destroy_drawable_checked(conn, shared);
+        xcb_disconnect(conn);
+
+        struct mock_stats stats;
+        mock_get_stats(&stats);
+        mock_fini();
+
+        if (stats.live_bos || stats.live_pixmaps) {
+                fprintf(stderr, "%lli BOs and %lli pixmaps leaked\n",
+                        (long long) stats.live_bos,
+                        (long long) stats.live_pixmaps);
+                ok = false;
+        }
+
+        return ok ? 0 : 1;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2022 Icecream95 <ixn@disroot.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TRACE_INCLUDE_GUARD
+#define TRACE_INCLUDE_GUARD
+
+/* Event tracing, enabled with DRI2TO3_TRACE=<file>.  Every thread records
+ * into its own ring, so tracing takes no locks; the rings are written out
+ * as Chrome trace JSON (loadable in Perfetto) at exit, or by a thread of
+ * their own when the process receives SIGUSR1. */
+
+#define TRACE_RING_SIZE 4096
+
+enum trace_type {
+        TRACE_GET_BUFFERS,
+        TRACE_SWAP,
+        TRACE_PRESENT,
+        TRACE_COMPLETE,
+        TRACE_IDLE,
+        TRACE_CONFIGURE,
+        TRACE_ALLOC,
+        TRACE_FREE,
+        TRACE_WAIT,
+};
+
+static const char *trace_names[] = {
+        [TRACE_GET_BUFFERS] = "get_buffers",
+        [TRACE_SWAP] = "swap",
+        [TRACE_PRESENT] = "present",
+        [TRACE_COMPLETE] = "complete",
+        [TRACE_IDLE] = "idle",
+        [TRACE_CONFIGURE] = "configure",
+        [TRACE_ALLOC] = "alloc",
+        [TRACE_FREE] = "free",
+        [TRACE_WAIT] = "wait",
+};
+
+enum trace_phase {
+        TRACE_INSTANT = 'i',
+        TRACE_BEGIN = 'B',
+        TRACE_END = 'E',
+};
+
+struct trace_event {
+        uint64_t ts;
+        uint8_t type;
+        uint8_t phase;
+        uint32_t drawable;
+        uint64_t arg;
+};
+
+struct trace_ring {
+        struct trace_ring *next;
+        pid_t tid;
+        atomic_uint_fast64_t head;
+        struct trace_event events[TRACE_RING_SIZE];
+};
+
+static bool trace_enabled;
+static const char *trace_path;
+static sem_t trace_dump_sem;
+static pthread_mutex_t trace_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(struct trace_ring *) trace_rings;
+static __thread struct trace_ring *trace_ring;
+
+static inline uint64_t
+trace_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline struct trace_ring *
+trace_ring_create(void)
+{
+        struct trace_ring *r = calloc(1, sizeof(*r));
+        r->tid = gettid();
+
+        struct trace_ring *head = atomic_load(&trace_rings);
+        do {
+                r->next = head;
+        } while (!atomic_compare_exchange_weak(&trace_rings, &head, r));
+
+        return r;
+}
+
+static inline void
+trace_dump(void)
+{
+        pthread_mutex_lock(&trace_dump_lock);
+
+        FILE *f = fopen(trace_path, "w");
+        if (!f) {
+                pthread_mutex_unlock(&trace_dump_lock);
+                return;
+        }
+
+        pid_t pid = getpid();
+        bool first = true;
+
+        fprintf(f, "{\"traceEvents\":[");
+
+        for (struct trace_ring *r = atomic_load(&trace_rings); r; r = r->next) {
+                uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+                uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+                for (uint64_t i = start; i < head; ++i) {
+                        struct trace_event ev = r->events[i % TRACE_RING_SIZE];
+
+                        /* Skip slots the owning thread has overwritten
+                         * since, or is writing: it stores event i +
+                         * TRACE_RING_SIZE before advancing head past it */
+                        uint64_t now = atomic_load_explicit(&r->head, memory_order_acquire);
+                        if (now - i >= TRACE_RING_SIZE)
+                                continue;
+
+                        fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                                "\"pid\":%d,\"tid\":%d,%s\"args\":{\"drawable\":\"0x%x\","
+                                "\"arg\":%" PRIu64 "}}",
+                                first ? "" : ",", trace_names[ev.type], ev.phase,
+                                ev.ts / 1000.0, pid, r->tid,
+                                ev.phase == TRACE_INSTANT ? "\"s\":\"t\"," : "",
+                                ev.drawable, ev.arg);
+                        first = false;
+                }
+        }
+
+        fprintf(f, "\n]}\n");
+        fclose(f);
+
+        pthread_mutex_unlock(&trace_dump_lock);
+}
+
+static inline void
+trace_record(enum trace_type type, enum trace_phase phase,
+             uint32_t drawable, uint64_t arg)
+{
+        if (__builtin_expect(!trace_enabled, true))
+                return;
+
+        struct trace_ring *r = trace_ring;
+        if (!r)
+                r = trace_ring = trace_ring_create();
+
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        r->events[head % TRACE_RING_SIZE] = (struct trace_event) {
+                .ts = trace_now(),
+                .type = type,
+                .phase = phase,
+                .drawable = drawable,
+                .arg = arg,
+        };
+        atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+#define TRACE(type, drawable, arg) \
+        trace_record(type, TRACE_INSTANT, drawable, arg)
+#define TRACE_BEGIN(type, drawable) \
+        trace_record(type, TRACE_BEGIN, drawable, 0)
+#define TRACE_END(type, drawable) \
+        trace_record(type, TRACE_END, drawable, 0)
+
+static void
+trace_signal(int sig)
+{
+        sem_post(&trace_dump_sem);
+}
+
+static void *
+trace_dump_thread(void *data)
+{
+        for (;;) {
+                while (sem_wait(&trace_dump_sem))
+                        ;
+                trace_dump();
+        }
+
+        return NULL;
+}
+
+static void __attribute__((destructor))
+trace_fini(void)
+{
+        if (trace_enabled)
+                trace_dump();
+}
+
+static inline void
+trace_init(void)
+{
+        trace_path = getenv("DRI2TO3_TRACE");
+        if (!trace_path || !*trace_path)
+                return;
+
+        pthread_t thread;
+        sem_init(&trace_dump_sem, 0, 0);
+        if (!pthread_create(&thread, NULL, trace_dump_thread, NULL)) {
+                pthread_detach(thread);
+                signal(SIGUSR1, trace_signal);
+        }
+
+        trace_enabled = true;
+}
+
+#endif